@@ -0,0 +1,465 @@
+/******************************************************************************************
+ * Latency and throughput of every way user space can read NVRAM, side by side.
+ *
+ * Each method reads bank 1 byte 0x7E (offset 0xFE, the my_attr_7e byte) one at a time, then
+ * the whole of bank 1 (128 bytes) per call. Every call is timed with rdtsc on one pinned CPU
+ * after a warmup, and reported as percentiles converted to ns, plus ops/s and MB/s over the
+ * timed loop. -H adds a log2 histogram per row, bucketed like the driver's debugfs latency file.
+ *     ports   in/out on 0x72/0x73 after ioperm, as cmos_user.c's ext_cmos_read did
+ *     ioctl   MY_DEV_READ per byte, served from the driver's shadow (cmos_dev_user.c)
+ *     readhw  MY_DEV_READ_HW per byte, a port access under the driver's lock
+ *     sysfs   my_attr_7e per byte; the bank binary attribute in bulk
+ *     pread   pread() on /dev/my-dev
+ *     readv   MY_DEV_READV, one entry per byte or the whole bank per call
+ *     mmap    loads from the mapped shadow page; seq-checked copy in bulk
+ *     lib     libcmos with the path it picks on its own
+ * io_uring has its own throughput test: cmos_dev_user uringbench.
+ *
+ * gcc -O2 -Wall -o cmos_bench cmos_bench.c libcmos.c
+ *
+ * Without the extended bank, load the driver on its simulated backend first; sim_latency_ns
+ * stands in for the port access time:
+ *     modprobe cmos_dev backend=sim sim_latency_ns=1000
+ * ports is skipped while the driver is loaded, as the two would fight over the index
+ * register, and there is nothing behind 0x72 without the hardware anyway. Name it in -m to run
+ * it regardless.
+ *
+ * ./cmos_bench [-m METHOD,...] [-c CPU] [-n ITERATIONS] [-w WARMUP] [-H]
+ *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>       // strtol, qsort
+#include <fcntl.h>        // open
+#include <unistd.h>       // close, pread, getopt
+#include <sys/ioctl.h>    // ioctl
+#include <string.h>       // strcmp
+#include <stdint.h>       // uint32_t, etc
+#include <sched.h>        // sched_setaffinity
+#include <time.h>         // clock_gettime
+#include <libgen.h>       // basename
+#include <sys/mman.h>     // mmap
+#include <sys/io.h>       // ioperm, inb, outb
+#include <x86intrin.h>    // __rdtsc, __rdtscp, _mm_lfence
+
+#include "libcmos.h"
+
+#define BENCH_OFFSET     0xFE                    // my_attr_7e
+#define BENCH_BULK       MY_DEV_BANK_SIZE        // all of bank 1
+#define BENCH_PORT       0x72
+#define BENCH_HIST_MAX   32                      // log2 ns buckets
+#define SYSFS_ATTRS      "/sys/class/my-dev-class/%s/my-dev-attrs/%s"
+
+typedef struct bench
+{
+    int                        fd;              // /dev/my-dev
+    int                        attr_fd;         // my_attr_7e
+    int                        bank_fd;         // bank
+    const mydev_shadow_page_t *page;
+    cmos_t                    *lib;
+    mydev_vec_entry_t          entries[BENCH_BULK];
+    mydev_vec_t                vec;
+    uint8_t                    buf[MY_DEV_NVRAM_SIZE];
+    volatile uint8_t           sink;            // keeps the compiler from dropping loads
+} bench_t;
+
+typedef struct method
+{
+    const char *name;
+    int       (*setup)(bench_t *b);             // 0, or -1 to skip the method
+    int       (*run)(bench_t *b, int bulk);     // one timed call
+    int         explicit_only;                  // run only when named in -m
+} method_t;
+
+static inline uint64_t tsc_start(void)
+{
+    _mm_lfence();
+    return __rdtsc();
+}
+
+static inline uint64_t tsc_stop(void)
+{
+    unsigned aux;
+    uint64_t t = __rdtscp(&aux);
+    _mm_lfence();
+    return t;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// TSC ticks per ns, against CLOCK_MONOTONIC over 100 ms
+static double tsc_per_ns(void)
+{
+    double   start = now_sec();
+    uint64_t t0    = tsc_start();
+    double   end;
+
+    while( (end = now_sec()) - start < 0.1 )
+        ;
+    return (tsc_stop() - t0) / ((end - start) * 1e9);
+}
+
+/******************************************************************************************
+ * Methods
+ *****************************************************************************************/
+
+static int setup_dev(bench_t *b)
+{
+    if( b->fd < 0 )
+        b->fd = open(cmos_default_path(), O_RDWR);
+    return (b->fd < 0) ? -1 : 0;
+}
+
+static int setup_ports(bench_t *b)
+{
+    (void)b;
+    return ioperm(BENCH_PORT, 2, 1) ? -1 : 0;
+}
+
+static int run_ports(bench_t *b, int bulk)
+{
+    if( !bulk )
+    {
+        outb(BENCH_OFFSET - MY_DEV_BANK1_BASE, BENCH_PORT);
+        b->sink = inb(BENCH_PORT + 1);
+        return 0;
+    }
+    for( int i = 0; i < BENCH_BULK; i++ )
+    {
+        outb(i, BENCH_PORT);
+        b->buf[i] = inb(BENCH_PORT + 1);
+    }
+    return 0;
+}
+
+static int run_ioctl_cmd(bench_t *b, int bulk, unsigned long cmd)
+{
+    mydev_data_t d = { .data = 0, .offset = BENCH_OFFSET };
+
+    if( !bulk )
+        return ioctl(b->fd, cmd, &d);
+    for( int i = 0; i < BENCH_BULK; i++ )
+    {
+        d.offset = MY_DEV_BANK1_BASE + i;
+        if( ioctl(b->fd, cmd, &d) != 0 )
+            return -1;
+        b->buf[i] = d.data;
+    }
+    return 0;
+}
+
+static int run_ioctl(bench_t *b, int bulk)
+{
+    return run_ioctl_cmd(b, bulk, MY_DEV_READ);
+}
+
+static int run_readhw(bench_t *b, int bulk)
+{
+    return run_ioctl_cmd(b, bulk, MY_DEV_READ_HW);
+}
+
+static int setup_sysfs(bench_t *b)
+{
+    char path[256];
+    char dev[64];
+
+    // The class device is named after the /dev node: my-dev, my-dev1, ...
+    snprintf(dev, sizeof(dev), "%s", cmos_default_path());
+    snprintf(path, sizeof(path), SYSFS_ATTRS, basename(dev), "my_attr_7e");
+    b->attr_fd = open(path, O_RDONLY);
+    snprintf(path, sizeof(path), SYSFS_ATTRS, basename(dev), "bank");
+    b->bank_fd = open(path, O_RDONLY);
+    return (b->attr_fd < 0 || b->bank_fd < 0) ? -1 : 0;
+}
+
+static int run_sysfs(bench_t *b, int bulk)
+{
+    // sysfs only calls show() for a read at offset 0, hence pread rather than read
+    if( !bulk )
+        return (pread(b->attr_fd, b->buf, sizeof(b->buf), 0) > 0) ? 0 : -1;
+    return (pread(b->bank_fd, b->buf, BENCH_BULK, MY_DEV_BANK1_BASE) == BENCH_BULK) ? 0 : -1;
+}
+
+static int run_pread(bench_t *b, int bulk)
+{
+    if( !bulk )
+        return (pread(b->fd, b->buf, 1, BENCH_OFFSET) == 1) ? 0 : -1;
+    return (pread(b->fd, b->buf, BENCH_BULK, MY_DEV_BANK1_BASE) == BENCH_BULK) ? 0 : -1;
+}
+
+static int setup_readv(bench_t *b)
+{
+    for( int i = 0; i < BENCH_BULK; i++ )
+    {
+        b->entries[i].offset   = MY_DEV_BANK1_BASE + i;
+        b->entries[i].op       = MY_DEV_OP_READ;
+        b->entries[i].data     = 0;
+        b->entries[i].reserved = 0;
+    }
+    b->vec.entries  = (uint64_t)(uintptr_t)b->entries;
+    b->vec.reserved = 0;
+    return setup_dev(b);
+}
+
+static int run_readv(bench_t *b, int bulk)
+{
+    // Byte: the single entry still covers 0xFE
+    b->vec.entries = (uint64_t)(uintptr_t)(bulk ? b->entries : &b->entries[BENCH_OFFSET - MY_DEV_BANK1_BASE]);
+    b->vec.count   = bulk ? BENCH_BULK : 1;
+    return ioctl(b->fd, MY_DEV_READV, &b->vec);
+}
+
+static int setup_mmap(bench_t *b)
+{
+    void *page;
+
+    if( setup_dev(b) )
+        return -1;
+    page = mmap(NULL, sizeof(*b->page), PROT_READ, MAP_SHARED, b->fd, 0);
+    if( page == MAP_FAILED )
+        return -1;
+    b->page = page;
+    return 0;
+}
+
+static int run_mmap(bench_t *b, int bulk)
+{
+    uint32_t seq;
+
+    if( !bulk )
+    {
+        b->sink = __atomic_load_n(&b->page->nvram[BENCH_OFFSET], __ATOMIC_RELAXED);
+        return 0;
+    }
+    // Bank 1 alone, so only its seq matters
+    do
+    {
+        while( (seq = __atomic_load_n(&b->page->seq[1], __ATOMIC_ACQUIRE)) & 1 )
+            ;
+        memcpy(b->buf, &b->page->nvram[MY_DEV_BANK1_BASE], BENCH_BULK);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while( __atomic_load_n(&b->page->seq[1], __ATOMIC_RELAXED) != seq );
+    return 0;
+}
+
+static int setup_lib(bench_t *b)
+{
+    b->lib = cmos_open(NULL, 0);
+    return b->lib ? 0 : -1;
+}
+
+static int run_lib(bench_t *b, int bulk)
+{
+    if( !bulk )
+        return cmos_read(b->lib, BENCH_OFFSET, &b->buf[0]);
+    return cmos_read_range(b->lib, MY_DEV_BANK1_BASE, b->buf, BENCH_BULK);
+}
+
+static const method_t methods[] = {
+    { "ports",  setup_ports, run_ports,  1 },
+    { "ioctl",  setup_dev,   run_ioctl,  0 },
+    { "readhw", setup_dev,   run_readhw, 0 },
+    { "sysfs",  setup_sysfs, run_sysfs,  0 },
+    { "pread",  setup_dev,   run_pread,  0 },
+    { "readv",  setup_readv, run_readv,  0 },
+    { "mmap",   setup_mmap,  run_mmap,   0 },
+    { "lib",    setup_lib,   run_lib,    0 },
+};
+#define NUM_METHODS (int)(sizeof(methods) / sizeof(methods[0]))
+
+/******************************************************************************************
+ * Measurement
+ *****************************************************************************************/
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_hist(const uint64_t *sorted, int n, double per_ns)
+{
+    unsigned hist[BENCH_HIST_MAX] = { 0 };
+
+    for( int i = 0; i < n; i++ )
+    {
+        uint64_t ns = (uint64_t)(sorted[i] / per_ns);
+        int      b  = ns ? 63 - __builtin_clzll(ns) : 0;
+        hist[(b < BENCH_HIST_MAX) ? b : BENCH_HIST_MAX - 1]++;
+    }
+    for( int b = 0; b < BENCH_HIST_MAX; b++ )
+        if( hist[b] )
+            printf("    %12llu ns+ %u\n", 1ULL << b, hist[b]);
+}
+
+static uint64_t pct(const uint64_t *sorted, int n, double p)
+{
+    int i = (int)(p / 100.0 * n);
+    return sorted[(i < n) ? i : n - 1];
+}
+
+static int measure(bench_t *b, const method_t *m, int bulk, uint64_t *samples, int iters, int warmup,
+                   double per_ns, uint64_t overhead, int hist)
+{
+    int size = bulk ? BENCH_BULK : 1;
+
+    for( int i = 0; i < warmup; i++ )
+        if( m->run(b, bulk) != 0 )
+            return -1;
+
+    double start = now_sec();
+    for( int i = 0; i < iters; i++ )
+    {
+        uint64_t t0 = tsc_start();
+        int      ret = m->run(b, bulk);
+        uint64_t t1 = tsc_stop();
+
+        if( ret != 0 )
+            return -1;
+        samples[i] = (t1 - t0 > overhead) ? t1 - t0 - overhead : 0;
+    }
+    double elapsed = now_sec() - start;
+
+    qsort(samples, iters, sizeof(*samples), cmp_u64);
+    printf("%-7s %4d %9.0f %9.0f %9.0f %9.0f %9.0f %12.0f %9.2f\n", m->name, size,
+           pct(samples, iters, 50) / per_ns, pct(samples, iters, 90) / per_ns,
+           pct(samples, iters, 99) / per_ns, pct(samples, iters, 99.9) / per_ns,
+           samples[iters - 1] / per_ns, iters / elapsed, iters * size / elapsed / 1e6);
+    if( hist )
+        print_hist(samples, iters, per_ns);
+    return 0;
+}
+
+static int selected(const char *list, const method_t *m, int driver)
+{
+    if( !list )
+        return !m->explicit_only || !driver;
+
+    char  copy[256];
+    char *save, *tok;
+    snprintf(copy, sizeof(copy), "%s", list);
+    for( tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save) )
+        if( strcmp(tok, m->name) == 0 )
+            return 1;
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *list    = NULL;
+    int         cpu     = -1;
+    int         iters   = 100000;
+    int         warmup  = 1000;
+    int         hist    = 0;
+    int         opt;
+    bench_t     b;
+
+    while( (opt = getopt(argc, argv, "m:c:n:w:H")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'm': list   = optarg;                            break;
+            case 'c': cpu    = (int)strtol(optarg, NULL, 0);      break;
+            case 'n': iters  = (int)strtol(optarg, NULL, 0);      break;
+            case 'w': warmup = (int)strtol(optarg, NULL, 0);      break;
+            case 'H': hist   = 1;                                 break;
+            default:
+                printf("Usage: %s [-m ports,ioctl,readhw,sysfs,pread,readv,mmap,lib] [-c CPU] [-n ITERATIONS] [-w WARMUP] [-H]\n", argv[0]);
+                return -1;
+        }
+    }
+    if( iters < 1 || warmup < 0 )
+    {
+        printf("Bad iteration or warmup count\n");
+        return -1;
+    }
+    if( list )
+    {
+        char  copy[256];
+        char *save, *tok;
+        snprintf(copy, sizeof(copy), "%s", list);
+        for( tok = strtok_r(copy, ",", &save); tok; tok = strtok_r(NULL, ",", &save) )
+        {
+            int m;
+            for( m = 0; m < NUM_METHODS && strcmp(tok, methods[m].name) != 0; m++ )
+                ;
+            if( m == NUM_METHODS )
+            {
+                printf("Unknown method: %s\n", tok);
+                return -1;
+            }
+        }
+    }
+
+    // One CPU for the whole run: no migrations, and one TSC for every sample
+    cpu_set_t set;
+    if( cpu < 0 )
+        cpu = sched_getcpu();
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if( sched_setaffinity(0, sizeof(set), &set) != 0 )
+    {
+        printf("Failed to pin to CPU %d\n", cpu);
+        return -1;
+    }
+
+    uint64_t *samples = calloc(iters, sizeof(*samples));
+    if( !samples )
+        return -1;
+
+    double   per_ns   = tsc_per_ns();
+    uint64_t overhead = UINT64_MAX;
+    for( int i = 0; i < 1000; i++ )
+    {
+        uint64_t t0 = tsc_start();
+        uint64_t t1 = tsc_stop();
+        if( t1 - t0 < overhead )
+            overhead = t1 - t0;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.fd = b.attr_fd = b.bank_fd = -1;
+    int driver = (access(cmos_default_path(), F_OK) == 0);
+
+    printf("cpu %d, tsc %.1f MHz, rdtsc overhead %llu cycles (subtracted), %d iterations after %d warmup\n",
+           cpu, per_ns * 1000, (unsigned long long)overhead, iters, warmup);
+    printf("%-7s %4s %9s %9s %9s %9s %9s %12s %9s\n", "method", "size", "p50 ns", "p90 ns", "p99 ns",
+           "p99.9 ns", "max ns", "ops/s", "MB/s");
+
+    int ret = 0;
+    for( int m = 0; m < NUM_METHODS; m++ )
+    {
+        if( !selected(list, &methods[m], driver) )
+            continue;
+        if( methods[m].setup(&b) != 0 )
+        {
+            printf("%-7s skipped: %m\n", methods[m].name);
+            continue;
+        }
+        for( int bulk = 0; bulk < 2; bulk++ )
+        {
+            if( measure(&b, &methods[m], bulk, samples, iters, warmup, per_ns, overhead, hist) != 0 )
+            {
+                printf("%-7s %4d failed: %m\n", methods[m].name, bulk ? BENCH_BULK : 1);
+                ret = -1;
+            }
+        }
+    }
+
+    if( b.page )
+        munmap((void *)b.page, sizeof(*b.page));
+    cmos_close(b.lib);
+    if( b.fd >= 0 )
+        close(b.fd);
+    if( b.attr_fd >= 0 )
+        close(b.attr_fd);
+    if( b.bank_fd >= 0 )
+        close(b.bank_fd);
+    free(samples);
+    return ret;
+}
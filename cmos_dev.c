@@ -83,278 +83,2640 @@
 #include <linux/dmi.h>
 #include <linux/device.h>
 #include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/atomic.h>
+#include <linux/moduleparam.h>
+#include <linux/mm.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/irq_work.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/mutex.h>
+#include <linux/timekeeping.h>
+#include <linux/workqueue.h>
+#include <linux/bitmap.h>
+#include <linux/jiffies.h>
+#include <linux/delay.h>
+#include <linux/string.h>
+#include <linux/irqflags.h>
+#include <linux/mc146818rtc.h>    // rtc_lock, RTC_* registers
+#include <linux/rtc.h>
+#include <linux/bcd.h>
+#include <linux/math64.h>
+#include <linux/list.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>    // local_clock
+#include <linux/log2.h>
+#include <linux/io_uring.h>
+#include <linux/jhash.h>
 #include <asm/nmi.h>
 #include <linux/umh.h>
+#include <net/genetlink.h>
 
 #include "cmos_dev.h"
 
+#define CREATE_TRACE_POINTS
+#include "cmos_dev_trace.h"
+
 #define IO_RTC_BANK0_INDEX_PORT              0x70    // CMOS RTC & NVRAM
 #define IO_RTC_BANK0_DATA_PORT               0x71    // CMOS RTC & NVRAM
-#define IO_RTC_BANK1_INDEX_PORT              0x72    // extended CMOS NVRAM
+#define IO_RTC_BANK1_INDEX_PORT              0x72    // extended CMOS NVRAM, default io_base
 #define IO_RTC_BANK1_DATA_PORT               0x73    // extended CMOS NVRAM
 #define IO_RTC_NUM_PORTS                     4
 
-#define DRV_NAME    "my-dev-drv"
+#define DRV_NAME    "my-dev-drv"
+
+// One platform device, /dev node, lock set and shadow per instance. Instance 0 is
+// /dev/my-dev at minor 0, instance N is /dev/my-devN at minor N + 1; minor 1 stays the
+// NMI event stream.
+#define MY_DEV_MAX_INSTANCES    8
+
+// Module-wide: the class and chrdev major every instance's node is created under, and the
+// platform devices my_dev_init creates, one per entry of the backend parameter
+static struct class           *my_dev_class = 0;
+static int                     my_dev_major;
+static struct platform_device *my_dev_pdevs[MY_DEV_MAX_INSTANCES];
+
+// Probed instances by id, for open() and the exported API; my_dev_insts_lock orders open()
+// against remove
+static struct my_dev_inst     *my_dev_insts[MY_DEV_MAX_INSTANCES];
+static DEFINE_MUTEX(my_dev_insts_lock);
+static bool                    my_dev_rtc_taken;    // an instance runs rtc_work; under my_dev_insts_lock
+
+static int my_dev_probe(struct platform_device *pdev);
+static int my_dev_remove(struct platform_device *pdev);
+
+// Netlink events; group indexes follow my_dev_genl_mcgrps
+enum { MY_DEV_GENL_GRP_CHANGE, MY_DEV_GENL_GRP_NMI };
+static struct genl_family my_dev_genl_family;
+
+// No unbind through sysfs: an open or mmapped /dev node points at its instance and shadow
+// page, and both are freed at remove. Without the bind attributes remove only runs at module
+// unload, which every open file (and so every mapping) holds off through my_dev_fops.owner.
+static struct platform_driver my_dev_driver = {
+    .driver = {
+        .name                = DRV_NAME,
+        .owner               = THIS_MODULE,
+        .suppress_bind_attrs = true,
+    },
+    .probe     = my_dev_probe,
+    .remove    = my_dev_remove,
+};
+
+// Per-CPU so that lock-free readers on different CPUs never share a counter cache line
+struct my_dev_stats {
+    u64 shadow_hits;
+    u64 hw_reads;
+    u64 wb_writes;          // dirty bytes written to the port by a flush
+    u64 wb_elided;          // dirty bytes a flush skipped since the port already held the value
+};
+
+// Timed operations, reported in debugfs/my-dev/latency. The lock_wait_* entries time
+// spin_lock() alone, so they show how contended each bank is; lock_hold_* time each hold from
+// acquire to release, which is what the waiters wait out.
+#define MY_DEV_OPS(X)       \
+    X(ioctl)                \
+    X(uring_cmd)            \
+    X(read)                 \
+    X(write)                \
+    X(sysfs_show)           \
+    X(sysfs_store)          \
+    X(sysfs_bank)           \
+    X(read0)                \
+    X(write0)               \
+    X(bulk0)                \
+    X(port_read)            \
+    X(port_write)           \
+    X(lock_wait_bank0)      \
+    X(lock_wait_bank1)      \
+    X(lock_hold_bank0)      \
+    X(lock_hold_bank1)
+
+#define MY_OP_ENUM(_name)   MY_OP_##_name,
+#define MY_OP_NAME(_name)   #_name,
+enum my_dev_op { MY_DEV_OPS(MY_OP_ENUM) MY_OP_NR };
+static const char *const my_dev_op_names[] = { MY_DEV_OPS(MY_OP_NAME) };
+
+// Bucket b counts operations that took [2^b, 2^(b+1)) ns; the last one everything slower
+#define MY_HIST_BUCKETS     32
+
+struct my_dev_hist {
+    u64 count;
+    u64 total_ns;
+    u64 bucket[MY_HIST_BUCKETS];
+};
+
+struct my_dev_hists {
+    struct my_dev_hist op[MY_OP_NR];
+};
+
+struct my_dev_inst;
+
+// Backend accessors take an offset in the unified 0x00-0xFF space; see Backends below
+struct my_dev_backend {
+    const char *name;
+    bool        needs_ports;    // claim io_base..+1 at probe
+    void        (*init)(struct my_dev_inst *md);    // optional, called at probe before the first access
+    uint8_t     (*read)(struct my_dev_inst *md, uint8_t addr);
+    void        (*write)(struct my_dev_inst *md, uint8_t addr, uint8_t val);
+};
+
+/****************************************************************************************
+ * Instances
+ *
+ * Everything the driver keeps about one NVRAM lives in struct my_dev_inst, allocated at
+ * probe and found through the platform device's drvdata, the /dev node's drvdata (sysfs),
+ * the watcher in file->private_data (file operations) or container_of (work items). So a
+ * sim instance and a port instance, or two port instances on different bank 1 ports, run
+ * side by side without sharing a lock. Bank 0 of a port instance is the RTC's, and the
+ * only thing still shared: its accesses take the kernel's rtc_lock, whatever the instance.
+ * Instance 0 serves the exported API and the NMI handler. An instance is pinned from probe
+ * to module unload (the driver has no sysfs unbind), so open files never outlive theirs.
+ *
+ *     modprobe cmos_dev backend=port,sim,sim
+ ***************************************************************************************/
+
+#define MY_DEV_KV_SLOTS     128    // named variable index; a power of two above the records that fit
+
+struct my_dev_inst {
+    int                          id;
+    struct device               *dev;           // the /dev node; cleared at remove to stop sysfs_notify()
+    dev_t                        devt;
+    const struct my_dev_backend *be;
+    unsigned int                 io_base;       // bank 1 index port of the port backend; data port follows it
+
+    // Bit 7 of the bank 0 index port is the NMI disable bit; every index write carries it as
+    // found at probe instead of silently re-enabling (or disabling) NMIs
+    uint8_t                      rtc_nmi_bit;
+
+    // Serializes every index/data port sequence on a bank; see Locking. Cached reads never
+    // take it.
+    spinlock_t                   lock[MY_DEV_NUM_BANKS];
+    spinlock_t                  *bank_lock[MY_DEV_NUM_BANKS];
+    u64                          lock_at[MY_DEV_NUM_BANKS];    // local_clock() at acquire, under the bank's lock
+
+    // Shadow of both banks, kept in a page that user space can map read-only. Writers hold
+    // the bank's lock and update the port and the shadow together, bumping the bank's seq
+    // around it. Readers of a single byte just load it; multi-byte readers, in the kernel or
+    // through mmap, retry on seq.
+    mydev_shadow_page_t         *page;
+
+    // Write-back state, under the owning bank's lock. hw_image is what the ports hold as far
+    // as the driver knows; a dirty byte's new value is only in the shadow until wb_work
+    // runs. The bank boundary falls on a long boundary of dirty, so the non-atomic bitops
+    // of the two banks never share a word.
+    uint8_t                      hw_image[MY_DEV_NVRAM_SIZE];
+    DECLARE_BITMAP(dirty, MY_DEV_NVRAM_SIZE);
+    struct delayed_work          wb_work;
+
+    // Offsets whose shadow value changed since notify_work last ran; set under any bank lock
+    DECLARE_BITMAP(changed_bits, MY_DEV_NVRAM_SIZE);
+    // Set when the latest change of an offset was found on the port, clear when it was a
+    // write; and the values netlink listeners last heard of. See Netlink events.
+    DECLARE_BITMAP(hw_changed_bits, MY_DEV_NVRAM_SIZE);
+    uint8_t                      genl_seen[MY_DEV_NVRAM_SIZE];    // notify_work only
+    struct work_struct           notify_work;
+    struct delayed_work          sample_work;
+    struct list_head             watchers;
+    spinlock_t                   watch_lock;    // the list and every watcher's bitmaps
+    wait_queue_head_t            watch_wq;
+
+    // RTC snapshot, written only by rtc_work and read lock-free under seq like the shadow page
+    struct {
+        unsigned int seq;
+        time64_t     secs;      // RTC time at tick_ns
+        u64          tick_ns;   // monotonic time of the tick, or of the read when unsynced
+        u64          read_ns;   // monotonic time of the last RTC read
+        u32          error_us;
+    } rtc;
+    // Poll state of rtc_work, which only the RTC owner runs (see RTC time snapshot)
+    bool                         rtc_owner;
+    time64_t                     rtc_prev_secs;
+    u64                          rtc_prev_ns;
+    unsigned int                 rtc_hunt;
+    struct delayed_work          rtc_work;
+
+    // Checksum region; changed under all bank locks, used under the bank it lies in
+    mydev_csum_t                 csum;
+
+    // Index of the named variable directory, under the lock of its bank
+    struct {
+        bool    stale;                      // the area changed since the index was built
+        bool    formatted;
+        uint8_t end;                        // directory terminator, relative to MY_DEV_KV_BASE
+        uint8_t slot[MY_DEV_KV_SLOTS];      // record offsets by name hash, 0 when empty
+    } kv;
+
+    struct my_dev_stats __percpu *stats;
+    struct my_dev_hists __percpu *hist;
+    struct dentry               *debugfs;
+
+    uint8_t                      sim_ram[MY_DEV_NVRAM_SIZE];
+};
+
+// start is a local_clock() taken when op began; cheap enough to leave on all the time
+static void my_dev_hist_add(struct my_dev_inst *md, enum my_dev_op op, u64 start)
+{
+    u64          ns = local_clock() - start;
+    unsigned int b  = ns ? min_t(unsigned int, ilog2(ns), MY_HIST_BUCKETS - 1) : 0;
+
+    this_cpu_inc(md->hist->op[op].count);
+    this_cpu_add(md->hist->op[op].total_ns, ns);
+    this_cpu_inc(md->hist->op[op].bucket[b]);
+}
+
+static bool cache_reads = true;
+module_param(cache_reads, bool, 0644);
+MODULE_PARM_DESC(cache_reads, "Serve NVRAM reads from the in-kernel shadow (default: true)");
+
+static bool writeback = false;
+module_param(writeback, bool, 0644);
+MODULE_PARM_DESC(writeback, "Queue writes in the shadow and flush them to the ports later (default: false)");
+
+static unsigned int writeback_delay_ms = 100;
+module_param(writeback_delay_ms, uint, 0644);
+MODULE_PARM_DESC(writeback_delay_ms, "Delay before queued writes are flushed, in ms (default: 100)");
+
+static unsigned int sample_ms;
+module_param(sample_ms, uint, 0444);
+MODULE_PARM_DESC(sample_ms, "Period of the sampler that catches NVRAM changes made behind the driver's back, in ms; 0 disables it (default: 0)");
+
+static loff_t  my_dev_llseek(struct file *file, loff_t offset, int whence);
+static ssize_t my_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
+static ssize_t my_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
+static __poll_t my_dev_poll(struct file *file, poll_table *wait);
+static long    my_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
+static int     my_dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags);
+static int     my_dev_open(struct inode *inode, struct file *file);
+static int     my_dev_release(struct inode *inode, struct file *file);
+static int     my_dev_mmap(struct file *file, struct vm_area_struct *vma);
+static int     my_dev_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+
+static ssize_t my_attr_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t my_attr_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t bank_read(struct file *file, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t pos, size_t count);
+static ssize_t cache_hits_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t cache_hw_reads_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t nmi_dropped_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t wb_writes_show(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t wb_elided_show(struct device *dev, struct device_attribute *attr, char *buf);
+
+// NVRAM bytes exposed as my-dev-attrs/my_attr_<name>; add a line to expose another one.
+// The existing names are bank 1 indexes and keep their meaning; offset is the unified one.
+#define MY_DEV_NVRAM_ATTRS(X)   \
+    X(7d, 0xFD)                 \
+    X(7e, 0xFE)                 \
+    X(7f, 0xFF)
+
+// The offset rides in dev_ext_attribute.var so one show/store pair serves the whole table
+#define MY_ATTR_DEFINE(_name, _off)                                                         \
+    static struct dev_ext_attribute dev_attr_my_attr_##_name = {                           \
+        __ATTR(my_attr_##_name, 0644, my_attr_show, my_attr_store), (void *)(_off)          \
+    };
+#define MY_ATTR_ENTRY(_name, _off)  &dev_attr_my_attr_##_name.attr.attr,
+
+MY_DEV_NVRAM_ATTRS(MY_ATTR_DEFINE)
+
+// Which attribute to sysfs_notify() when an offset changes
+#define MY_ATTR_NOTIFY(_name, _off) { _off, "my_attr_" #_name },
+static const struct {
+    uint8_t     offset;
+    const char *name;
+} my_dev_attr_offsets[] = {
+    MY_DEV_NVRAM_ATTRS(MY_ATTR_NOTIFY)
+};
+static DEVICE_ATTR_RO(cache_hits);
+static DEVICE_ATTR_RO(cache_hw_reads);
+static DEVICE_ATTR_RO(nmi_dropped);
+static DEVICE_ATTR_RO(wb_writes);
+static DEVICE_ATTR_RO(wb_elided);
+static struct attribute *my_dev_attrs[] = {
+    MY_DEV_NVRAM_ATTRS(MY_ATTR_ENTRY)
+    &dev_attr_cache_hits.attr,
+    &dev_attr_cache_hw_reads.attr,
+    &dev_attr_nmi_dropped.attr,
+    &dev_attr_wb_writes.attr,
+    &dev_attr_wb_elided.attr,
+    NULL,
+};
+// Both banks in one read, for collectors that would otherwise open a file per byte
+static BIN_ATTR_RO(bank, MY_DEV_NVRAM_SIZE);
+static struct bin_attribute *my_dev_bin_attrs[] = {
+    &bin_attr_bank,
+    NULL,
+};
+static struct attribute_group my_dev_attr_group = {
+    .attrs     = my_dev_attrs,
+    .bin_attrs = my_dev_bin_attrs,
+    .name      = "my-dev-attrs",
+};
+
+static inline uint8_t ext_cmos_read(struct my_dev_inst *md, uint8_t addr)
+{
+    outb(addr, md->io_base);
+    return inb(md->io_base + 1);
+}
+
+static inline void ext_cmos_write(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    outb(addr, md->io_base);
+    outb(val, md->io_base + 1);
+}
+
+static inline uint8_t std_cmos_read(struct my_dev_inst *md, uint8_t addr)
+{
+    outb(md->rtc_nmi_bit | addr, IO_RTC_BANK0_INDEX_PORT);
+    return inb(IO_RTC_BANK0_DATA_PORT);
+}
+
+static inline void std_cmos_write(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    outb(md->rtc_nmi_bit | addr, IO_RTC_BANK0_INDEX_PORT);
+    outb(val, IO_RTC_BANK0_DATA_PORT);
+}
+
+/****************************************************************************************
+ * Backends
+ *
+ * Everything above the port accessors (shadow, locking, write-back, ioctl, sysfs) runs
+ * unchanged on either backend. "port" drives 0x70/0x71 and io_base/io_base+1 (0x72/0x73
+ * unless told otherwise); "sim" keeps both banks in RAM and busy-waits sim_latency_ns per
+ * emulated port access, so the driver can be load tested on machines without the extended
+ * bank:
+ *     modprobe cmos_dev backend=sim sim_latency_ns=1000
+ * Each entry of backend is one instance, so a list tests both side by side.
+ ***************************************************************************************/
+
+static char *backend[MY_DEV_MAX_INSTANCES] = { "port" };
+static int   nr_backend = 1;
+module_param_array(backend, charp, &nr_backend, 0444);
+MODULE_PARM_DESC(backend, "NVRAM backend of each instance, port or sim; one instance per entry (default: port)");
+
+static unsigned int io_base[MY_DEV_MAX_INSTANCES];
+static int          nr_io_base;
+module_param_array(io_base, uint, &nr_io_base, 0444);
+MODULE_PARM_DESC(io_base, "port backend: bank 1 index port of each instance, its data port follows (default: 0x72)");
+
+static unsigned int sim_latency_ns = 0;
+module_param(sim_latency_ns, uint, 0644);
+MODULE_PARM_DESC(sim_latency_ns, "sim backend: busy-wait per emulated port access, in ns (default: 0)");
+
+// Port 0x70 reads back as 0xFF on chipsets where it is write-only; assume NMIs enabled there
+static void my_dev_port_init(struct my_dev_inst *md)
+{
+    unsigned long flags;
+    uint8_t       index;
+
+    spin_lock_irqsave(&rtc_lock, flags);
+    index = inb(IO_RTC_BANK0_INDEX_PORT);
+    spin_unlock_irqrestore(&rtc_lock, flags);
+
+    md->rtc_nmi_bit = (index == 0xFF) ? 0 : (index & 0x80);
+}
+
+static uint8_t my_dev_port_read(struct my_dev_inst *md, uint8_t addr)
+{
+    if (addr < MY_DEV_BANK1_BASE)
+        return std_cmos_read(md, addr);
+    return ext_cmos_read(md, addr - MY_DEV_BANK1_BASE);
+}
+
+static void my_dev_port_write(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    if (addr < MY_DEV_BANK1_BASE)
+        std_cmos_write(md, addr, val);
+    else
+        ext_cmos_write(md, addr - MY_DEV_BANK1_BASE, val);
+}
+
+// An index write plus a data access, like the real thing
+static uint8_t my_dev_sim_read(struct my_dev_inst *md, uint8_t addr)
+{
+    ndelay(2 * sim_latency_ns);
+    return md->sim_ram[addr];
+}
+
+static void my_dev_sim_write(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    ndelay(2 * sim_latency_ns);
+    md->sim_ram[addr] = val;
+}
+
+static const struct my_dev_backend my_dev_backends[] = {
+    { .name = "port", .needs_ports = true,  .init = my_dev_port_init, .read = my_dev_port_read, .write = my_dev_port_write },
+    { .name = "sim",  .needs_ports = false, .init = 0,                .read = my_dev_sim_read,  .write = my_dev_sim_write  },
+};
+
+/****************************************************************************************
+ * Locking
+ *
+ * Each bank has its own lock so RTC traffic on bank 0 never waits for NVRAM traffic on
+ * bank 1, and each instance has its own pair. On the port backend bank 0 uses the kernel's
+ * rtc_lock instead, which rtc-cmos and every other user of ports 0x70/0x71 already take, so
+ * our index/data pairs cannot interleave with theirs. Callers name the banks they need as a
+ * mask; locks are always taken in bank order, so a batch spanning both banks cannot
+ * deadlock against another one.
+ ***************************************************************************************/
+
+#define MY_DEV_BANK(addr)       ((addr) / MY_DEV_BANK_SIZE)
+#define MY_DEV_BANK_BIT(addr)   (1U << MY_DEV_BANK(addr))
+#define MY_DEV_ALL_BANKS        ((1U << MY_DEV_NUM_BANKS) - 1)
+
+// Banks covered by [pos, pos + count); count > 0
+static unsigned int my_dev_banks_of(loff_t pos, size_t count)
+{
+    return MY_DEV_BANK_BIT(pos) | MY_DEV_BANK_BIT(pos + count - 1);
+}
+
+// Exclusive hold of the given banks for port access. Each held bank's seq is odd for the
+// whole hold, so a multi-byte reader never copies a half-applied batch. Interrupts stay off
+// so that an interrupt handler calling my_dev_read0/my_dev_write0 can neither deadlock on
+// the lock nor spin on an odd seq.
+static unsigned long my_dev_lock_hw(struct my_dev_inst *md, unsigned int banks)
+{
+    unsigned long flags;
+    int           b;
+
+    local_irq_save(flags);
+    for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+    {
+        u64 start;
+
+        if (!(banks & (1U << b)))
+            continue;
+        start = local_clock();
+        spin_lock(md->bank_lock[b]);
+        my_dev_hist_add(md, MY_OP_lock_wait_bank0 + b, start);
+        md->lock_at[b] = local_clock();
+        WRITE_ONCE(md->page->seq[b], md->page->seq[b] + 1);
+    }
+    smp_wmb();
+    return flags;
+}
+
+static void my_dev_unlock_hw(struct my_dev_inst *md, unsigned int banks, unsigned long flags)
+{
+    int b;
+
+    smp_wmb();
+    for (b = MY_DEV_NUM_BANKS - 1; b >= 0; b--)
+    {
+        if (!(banks & (1U << b)))
+            continue;
+        WRITE_ONCE(md->page->seq[b], md->page->seq[b] + 1);
+        my_dev_hist_add(md, MY_OP_lock_hold_bank0 + b, md->lock_at[b]);
+        spin_unlock(md->bank_lock[b]);
+    }
+    local_irq_restore(flags);
+}
+
+// Reader side of the seq protocol, over both banks
+static void my_dev_read_begin(struct my_dev_inst *md, uint32_t *seq)
+{
+    int b;
+
+    for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+        while ((seq[b] = smp_load_acquire(&md->page->seq[b])) & 1)
+            cpu_relax();
+}
+
+static bool my_dev_read_retry(struct my_dev_inst *md, const uint32_t *seq)
+{
+    int b;
+
+    smp_rmb();
+    for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+        if (READ_ONCE(md->page->seq[b]) != seq[b])
+            return true;
+    return false;
+}
+
+// Live RTC registers always go to the port
+static inline bool my_dev_cacheable(uint8_t addr)
+{
+    return cache_reads && addr >= MY_DEV_RTC_REGS;
+}
+
+// Offsets the write paths accept: the live RTC registers are refused, as MY_DEV_RESTORE does
+static inline bool my_dev_writable(uint32_t addr)
+{
+    return addr >= MY_DEV_RTC_REGS && addr < MY_DEV_NVRAM_SIZE;
+}
+
+// The only place the shadow changes, so the only place watchers need to hear about; caller
+// holds my_dev_lock_hw() for addr's bank. source is MY_DEV_CHANGE_*.
+static void my_dev_shadow_set(struct my_dev_inst *md, uint8_t addr, uint8_t val, uint8_t source)
+{
+    if (md->page->nvram[addr] == val)
+        return;
+
+    WRITE_ONCE(md->page->nvram[addr], val);
+    if (source == MY_DEV_CHANGE_HW)
+        set_bit(addr, md->hw_changed_bits);
+    else
+        clear_bit(addr, md->hw_changed_bits);
+    set_bit(addr, md->changed_bits);    // atomic: the other bank may be setting bits too
+    if ((unsigned int)(addr - MY_DEV_KV_BASE) < MY_DEV_KV_SIZE)
+        md->kv.stale = true;
+    schedule_work(&md->notify_work);
+}
+
+// Port access plus shadow upkeep; caller holds my_dev_lock_hw() for addr's bank
+static void my_dev_hw_write(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    u64 start = local_clock();
+
+    md->be->write(md, addr, val);
+    my_dev_hist_add(md, MY_OP_port_write, start);
+    md->hw_image[addr] = val;
+    my_dev_shadow_set(md, addr, val, MY_DEV_CHANGE_WRITE);
+}
+
+static uint8_t my_dev_hw_read(struct my_dev_inst *md, uint8_t addr)
+{
+    uint8_t val;
+
+    // A queued write is newer than the port; land it before reading back
+    if (__test_and_clear_bit(addr, md->dirty))
+        my_dev_hw_write(md, addr, md->page->nvram[addr]);
+
+    // Reading status register C would eat interrupts meant for rtc-cmos
+    if (addr == MY_DEV_RTC_REG_C)
+        val = 0;
+    else
+    {
+        u64 start = local_clock();
+
+        val = md->be->read(md, addr);
+        my_dev_hist_add(md, MY_OP_port_read, start);
+    }
+    md->hw_image[addr] = val;
+    my_dev_shadow_set(md, addr, val, MY_DEV_CHANGE_HW);    // a difference here is a change made behind our back
+    this_cpu_inc(md->stats->hw_reads);
+    return val;
+}
+
+// Caller holds my_dev_lock_hw() for addr's bank. In write-back mode the value only goes to
+// the shadow and the port write is left to wb_work; RTC registers are always written through.
+static void my_dev_store_byte(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    if (!writeback || addr < MY_DEV_RTC_REGS)
+    {
+        my_dev_hw_write(md, addr, val);
+        return;
+    }
+
+    my_dev_shadow_set(md, addr, val, MY_DEV_CHANGE_WRITE);
+    __set_bit(addr, md->dirty);
+    schedule_delayed_work(&md->wb_work, msecs_to_jiffies(writeback_delay_ms));    // no-op if already queued
+}
+
+/****************************************************************************************
+ * Checksum region
+ *
+ * Firmware guards some NVRAM ranges with a checksum (on PC/AT, a 16 bit sum of 0x10-0x2D
+ * at 0x2E/0x2F). With a region configured through MY_DEV_CSUM_SET, every write through the
+ * driver that changes a byte of the region moves the checksum by the difference, old byte
+ * out and new byte in, taking both the old byte and the checksum from the shadow: no port
+ * reads, and the checksum bytes go out through the same write-through or write-back path
+ * as the byte itself. Region and checksum share a bank, so the lock the write already holds
+ * covers the checksum too. MY_DEV_CSUM_VERIFY recomputes the whole sum, from the shadow.
+ *
+ * The difference is only right while nothing else writes the checksum. A range write, a
+ * batch or an image restore may carry the checksum bytes too (a consistent image does), and
+ * would then adjust them twice, or overwrite the adjusted sum with a stale one. So those go
+ * through my_dev_store_nosum() and recompute the sum once, after their last store.
+ ***************************************************************************************/
+
+static bool my_dev_csum_wide(uint8_t alg)
+{
+    return alg == MY_DEV_CSUM_SUM16_BE || alg == MY_DEV_CSUM_SUM16_LE;
+}
+
+static uint16_t my_dev_csum_calc(const mydev_csum_t *cs, const uint8_t *nvram)
+{
+    uint16_t     sum = 0;
+    unsigned int i;
+
+    for (i = cs->start; i <= cs->end; i++)
+        sum = (cs->alg == MY_DEV_CSUM_XOR8) ? sum ^ nvram[i] : sum + nvram[i];
+    return my_dev_csum_wide(cs->alg) ? sum : (uint8_t)sum;
+}
+
+static uint16_t my_dev_csum_get(const mydev_csum_t *cs, const uint8_t *nvram)
+{
+    switch (cs->alg)
+    {
+        case MY_DEV_CSUM_SUM16_BE: return nvram[cs->offset] << 8 | nvram[cs->offset + 1];
+        case MY_DEV_CSUM_SUM16_LE: return nvram[cs->offset] | nvram[cs->offset + 1] << 8;
+        default:                   return nvram[cs->offset];
+    }
+}
+
+// Caller holds my_dev_lock_hw() for the region's bank
+static void my_dev_csum_put(struct my_dev_inst *md, uint16_t sum)
+{
+    const mydev_csum_t *cs = &md->csum;
+
+    switch (cs->alg)
+    {
+        case MY_DEV_CSUM_SUM16_BE:
+            my_dev_store_byte(md, cs->offset,     sum >> 8);
+            my_dev_store_byte(md, cs->offset + 1, sum & 0xFF);
+            break;
+        case MY_DEV_CSUM_SUM16_LE:
+            my_dev_store_byte(md, cs->offset,     sum & 0xFF);
+            my_dev_store_byte(md, cs->offset + 1, sum >> 8);
+            break;
+        default:
+            my_dev_store_byte(md, cs->offset, sum);
+            break;
+    }
+}
+
+// Store without checksum upkeep, for writes of several bytes; true if a byte of the region
+// changed, and the caller then owes a my_dev_csum_refresh(). Caller holds my_dev_lock_hw()
+// for addr's bank.
+static bool my_dev_store_nosum(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    const mydev_csum_t *cs  = &md->csum;
+    uint8_t             old = md->page->nvram[addr];
+
+    my_dev_store_byte(md, addr, val);
+    return cs->alg != MY_DEV_CSUM_NONE && addr >= cs->start && addr <= cs->end && val != old;
+}
+
+// Recompute the checksum from the region; caller holds my_dev_lock_hw() for the region's bank
+static void my_dev_csum_refresh(struct my_dev_inst *md)
+{
+    const mydev_csum_t *cs = &md->csum;
+    uint16_t            sum;
+
+    if (cs->alg == MY_DEV_CSUM_NONE)
+        return;
+    sum = my_dev_csum_calc(cs, md->page->nvram);
+    if (sum != my_dev_csum_get(cs, md->page->nvram))
+        my_dev_csum_put(md, sum);
+}
+
+// Every single byte write path ends here; caller holds my_dev_lock_hw() for addr's bank
+static void my_dev_store(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    const mydev_csum_t *cs  = &md->csum;
+    uint8_t             old = md->page->nvram[addr];
+    uint16_t            sum;
+
+    if (!my_dev_store_nosum(md, addr, val))
+        return;
+
+    sum = my_dev_csum_get(cs, md->page->nvram);
+    if (cs->alg == MY_DEV_CSUM_XOR8)
+        sum ^= old ^ val;
+    else
+        sum += val - old;
+    my_dev_csum_put(md, sum);
+}
+
+// Region and checksum inside one bank, clear of the RTC registers, checksum after the region
+static bool my_dev_csum_valid(const mydev_csum_t *cs)
+{
+    unsigned int last = cs->offset + (my_dev_csum_wide(cs->alg) ? 1 : 0);
+
+    if (cs->alg == MY_DEV_CSUM_NONE)
+        return true;
+    if (cs->alg > MY_DEV_CSUM_XOR8 || cs->start > cs->end || last >= MY_DEV_NVRAM_SIZE)
+        return false;
+    if (cs->start < MY_DEV_RTC_REGS || cs->offset < MY_DEV_RTC_REGS)
+        return false;
+    if (cs->offset <= cs->end)
+        return false;
+    return MY_DEV_BANK(cs->start) == MY_DEV_BANK(cs->end) &&
+           MY_DEV_BANK(cs->offset) == MY_DEV_BANK(cs->start) && MY_DEV_BANK(last) == MY_DEV_BANK(cs->start);
+}
+
+// Write the dirty bytes back, skipping any whose value the port already holds (rewritten
+// with the same value, or changed and changed back); caller holds all banks
+static void my_dev_flush_locked(struct my_dev_inst *md)
+{
+    unsigned int addr;
+
+    for_each_set_bit(addr, md->dirty, MY_DEV_NVRAM_SIZE)
+    {
+        uint8_t val = md->page->nvram[addr];
+
+        if (val == md->hw_image[addr])
+        {
+            this_cpu_inc(md->stats->wb_elided);
+            continue;
+        }
+        my_dev_hw_write(md, addr, val);
+        this_cpu_inc(md->stats->wb_writes);
+    }
+    bitmap_zero(md->dirty, MY_DEV_NVRAM_SIZE);
+}
+
+// A single byte load can't tear, so this needs neither the lock nor seq
+static uint8_t my_dev_shadow_read(struct my_dev_inst *md, uint8_t addr)
+{
+    this_cpu_inc(md->stats->shadow_hits);
+    return READ_ONCE(md->page->nvram[addr]);
+}
+
+// Lock-free consistent copy of a shadow range; same protocol as the mmap readers
+static void my_dev_shadow_copy(struct my_dev_inst *md, uint8_t *dst, loff_t pos, size_t count)
+{
+    uint32_t seq[MY_DEV_NUM_BANKS];
+
+    do
+    {
+        my_dev_read_begin(md, seq);
+        memcpy(dst, &md->page->nvram[pos], count);
+    } while (my_dev_read_retry(md, seq));
+
+    this_cpu_add(md->stats->shadow_hits, count);
+}
+
+// Single byte accessors; hw forces a port read even when caching is on
+static uint8_t my_dev_read_byte(struct my_dev_inst *md, uint8_t addr, bool hw)
+{
+    unsigned long flags;
+    uint8_t       data;
+
+    if (!hw && my_dev_cacheable(addr))
+        return my_dev_shadow_read(md, addr);
+
+    flags = my_dev_lock_hw(md, MY_DEV_BANK_BIT(addr));
+    data  = my_dev_hw_read(md, addr);
+    my_dev_unlock_hw(md, MY_DEV_BANK_BIT(addr), flags);
+    return data;
+}
+
+static void my_dev_write_byte(struct my_dev_inst *md, uint8_t addr, uint8_t val)
+{
+    unsigned long flags;
+
+    flags = my_dev_lock_hw(md, MY_DEV_BANK_BIT(addr));
+    my_dev_store(md, addr, val);
+    my_dev_unlock_hw(md, MY_DEV_BANK_BIT(addr), flags);
+}
+
+// Current value as the caller would read it; caller holds my_dev_lock_hw() for addr's bank
+static uint8_t my_dev_load(struct my_dev_inst *md, uint8_t addr)
+{
+    return my_dev_cacheable(addr) ? my_dev_shadow_read(md, addr) : my_dev_hw_read(md, addr);
+}
+
+// MY_DEV_OP_{SET,CLEAR,TOGGLE}_BITS or MY_DEV_OP_CMPXCHG on one byte; returns the prior
+// value. Caller holds my_dev_lock_hw() for addr's bank, which is what makes the pair atomic.
+static uint8_t my_dev_rmw_locked(struct my_dev_inst *md, uint8_t op, uint8_t addr, uint8_t mask, uint8_t expected, uint8_t data)
+{
+    uint8_t old = my_dev_load(md, addr);
+    uint8_t val = old;
+
+    switch (op)
+    {
+        case MY_DEV_OP_SET_BITS:    val = old | mask;                      break;
+        case MY_DEV_OP_CLEAR_BITS:  val = old & ~mask;                     break;
+        case MY_DEV_OP_TOGGLE_BITS: val = old ^ mask;                      break;
+        case MY_DEV_OP_CMPXCHG:     val = (old == expected) ? data : old;  break;
+    }
+
+    if (val != old)
+        my_dev_store(md, addr, val);
+    return old;
+}
+
+static void my_dev_flush(struct my_dev_inst *md)
+{
+    unsigned long flags;
+
+    flags = my_dev_lock_hw(md, MY_DEV_ALL_BANKS);
+    my_dev_flush_locked(md);
+    my_dev_unlock_hw(md, MY_DEV_ALL_BANKS, flags);
+}
+
+static void my_dev_wb_fn(struct work_struct *work)
+{
+    my_dev_flush(container_of(to_delayed_work(work), struct my_dev_inst, wb_work));
+}
+
+/****************************************************************************************
+ * RTC time snapshot
+ *
+ * A coherent read of the RTC has to stay clear of the update cycle: from the moment UIP
+ * rises until the update ends (244 us + up to ~2 ms) the time registers are unreliable.
+ * Rather than every caller spinning through that window on 0x70/0x71, rtc_work samples
+ * the RTC and times its second tick: near the expected tick it polls once a jiffy, and
+ * once it sees UIP it sleeps through the update in small steps and reads the new time the
+ * moment UIP drops. MY_DEV_RTC_TIME then extrapolates from the tick with the monotonic
+ * clock, lock-free. The update-ended interrupt would be more precise but its IRQ belongs
+ * to rtc-cmos.
+ *
+ * There is one RTC, behind the legacy ports, so only the first port instance follows it.
+ * A sim instance has no clock (its registers stay zero), and a second port instance would
+ * only poll the same one again; MY_DEV_RTC_TIME fails with -EOPNOTSUPP on both.
+ ***************************************************************************************/
+
+#define MY_RTC_UIP_STEP_US  50                          // sleep step while an update is in progress
+#define MY_RTC_UIP_MAX_US   2500                        // an update never takes longer than this
+#define MY_RTC_LEAD         (msecs_to_jiffies(10) + 1)  // wake this early for the next tick
+#define MY_RTC_HUNT_MAX     (2 * HZ)                    // polls before taking the clock as stopped
+
+// Straight from the port: going through my_dev_hw_read would put every tick, and every UIP
+// flip while hunting, in the shadow as a change behind the driver's back, for watchers,
+// sysfs pollers and netlink listeners alike, and in hw_reads and port_read. The shadow never
+// serves these registers anyway. Caller holds my_dev_lock_hw() for bank 0.
+static inline uint8_t my_dev_rtc_reg(struct my_dev_inst *md, uint8_t reg)
+{
+    return md->be->read(md, reg);
+}
+
+// One read of the time registers; -EBUSY if an update is in progress or the clock is being set.
+// With UIP clear the update is at least 244 us away, which is plenty for the reads below.
+static int my_dev_rtc_sample(struct my_dev_inst *md, time64_t *secs)
+{
+    struct rtc_time tm;
+    unsigned long   flags;
+    uint8_t         ctrl;
+
+    flags = my_dev_lock_hw(md, MY_DEV_BANK_BIT(RTC_REG_A));
+    if (my_dev_rtc_reg(md, RTC_REG_A) & RTC_UIP)
+    {
+        my_dev_unlock_hw(md, MY_DEV_BANK_BIT(RTC_REG_A), flags);
+        return -EBUSY;
+    }
+    ctrl        = my_dev_rtc_reg(md, RTC_REG_B);
+    tm.tm_sec   = my_dev_rtc_reg(md, RTC_SECONDS);
+    tm.tm_min   = my_dev_rtc_reg(md, RTC_MINUTES);
+    tm.tm_hour  = my_dev_rtc_reg(md, RTC_HOURS);
+    tm.tm_mday  = my_dev_rtc_reg(md, RTC_DAY_OF_MONTH);
+    tm.tm_mon   = my_dev_rtc_reg(md, RTC_MONTH);
+    tm.tm_year  = my_dev_rtc_reg(md, RTC_YEAR);
+    my_dev_unlock_hw(md, MY_DEV_BANK_BIT(RTC_REG_A), flags);
+
+    if (ctrl & RTC_SET)
+        return -EBUSY;
+
+    // In 12 hour mode bit 7 of the hour is PM, and 12 is the first hour of either half
+    if (!(ctrl & RTC_24H))
+    {
+        bool pm = tm.tm_hour & 0x80;
+
+        tm.tm_hour &= 0x7F;
+        if (!(ctrl & RTC_DM_BINARY))
+            tm.tm_hour = bcd2bin(tm.tm_hour);
+        tm.tm_hour = (tm.tm_hour % 12) + (pm ? 12 : 0);
+    }
+    else if (!(ctrl & RTC_DM_BINARY))
+        tm.tm_hour = bcd2bin(tm.tm_hour);
+
+    if (!(ctrl & RTC_DM_BINARY))
+    {
+        tm.tm_sec  = bcd2bin(tm.tm_sec);
+        tm.tm_min  = bcd2bin(tm.tm_min);
+        tm.tm_mday = bcd2bin(tm.tm_mday);
+        tm.tm_mon  = bcd2bin(tm.tm_mon);
+        tm.tm_year = bcd2bin(tm.tm_year);
+    }
+
+    // Same century rule as rtc-cmos: 70-99 are 19xx, 00-69 are 20xx
+    tm.tm_mon -= 1;
+    if (tm.tm_year < 70)
+        tm.tm_year += 100;
+
+    *secs = rtc_tm_to_time64(&tm);
+    return 0;
+}
+
+static void my_dev_rtc_publish(struct my_dev_inst *md, time64_t secs, u64 tick_ns, u64 read_ns, u32 error_us)
+{
+    WRITE_ONCE(md->rtc.seq, md->rtc.seq + 1);
+    smp_wmb();
+    md->rtc.secs     = secs;
+    md->rtc.tick_ns  = tick_ns;
+    md->rtc.read_ns  = read_ns;
+    md->rtc.error_us = error_us;
+    smp_wmb();
+    WRITE_ONCE(md->rtc.seq, md->rtc.seq + 1);
+}
+
+static void my_dev_rtc_fn(struct work_struct *work)
+{
+    struct my_dev_inst *md = container_of(to_delayed_work(work), struct my_dev_inst, rtc_work);
+    time64_t            secs;
+    u64                 now;
+    unsigned int        waited;
+    int                 ret;
+
+    ret = my_dev_rtc_sample(md, &secs);
+    now = ktime_get_ns();
+
+    if (ret == -EBUSY)
+    {
+        // The tick is the end of this update; sleep through it rather than spin
+        for (waited = 0; ret == -EBUSY && waited < MY_RTC_UIP_MAX_US; waited += MY_RTC_UIP_STEP_US)
+        {
+            usleep_range(MY_RTC_UIP_STEP_US, 2 * MY_RTC_UIP_STEP_US);
+            ret = my_dev_rtc_sample(md, &secs);
+        }
+        if (ret == 0)
+        {
+            now = ktime_get_ns();
+            my_dev_rtc_publish(md, secs, now, now, 2 * MY_RTC_UIP_STEP_US);
+            goto synced;
+        }
+        goto hunt;    // still busy: the clock is being set
+    }
+
+    if (md->rtc_hunt && secs != md->rtc_prev_secs)
+    {
+        // The update fell between two polls without us seeing UIP: split the difference
+        my_dev_rtc_publish(md, secs, (md->rtc_prev_ns + now) / 2, now,
+                           div_u64(now - md->rtc_prev_ns, 2 * NSEC_PER_USEC));
+        goto synced;
+    }
+
+    // Nothing to go on yet (first read) or the clock isn't ticking: give callers the second
+    if (!READ_ONCE(md->rtc.tick_ns) || md->rtc_hunt >= MY_RTC_HUNT_MAX)
+    {
+        my_dev_rtc_publish(md, secs, now, now, MY_DEV_RTC_UNSYNCED);
+        if (md->rtc_hunt >= MY_RTC_HUNT_MAX)
+        {
+            md->rtc_hunt = 0;
+            schedule_delayed_work(&md->rtc_work, HZ);
+            return;
+        }
+    }
+
+    md->rtc_prev_secs = secs;
+    md->rtc_prev_ns   = now;
+hunt:
+    md->rtc_hunt++;
+    schedule_delayed_work(&md->rtc_work, 1);
+    return;
+
+synced:
+    // Sleep until just before the next tick, then hunt for it
+    md->rtc_hunt = 0;
+    schedule_delayed_work(&md->rtc_work, HZ - MY_RTC_LEAD);
+}
+
+static long my_dev_ioctl_rtc(struct my_dev_inst *md, unsigned long arg)
+{
+    mydev_rtc_time_t rt;
+    struct rtc_time  tm;
+    unsigned int     seq;
+    time64_t         secs;
+    u64              tick_ns, read_ns, now;
+    u32              error_us, rem;
+
+    if (!md->rtc_owner)
+        return -EOPNOTSUPP;
+
+    do
+    {
+        while ((seq = smp_load_acquire(&md->rtc.seq)) & 1)
+            cpu_relax();
+        secs     = md->rtc.secs;
+        tick_ns  = md->rtc.tick_ns;
+        read_ns  = md->rtc.read_ns;
+        error_us = md->rtc.error_us;
+        smp_rmb();
+    } while (READ_ONCE(md->rtc.seq) != seq);
+
+    if (!tick_ns)
+        return -EAGAIN;
+
+    now   = ktime_get_ns();
+    secs += div_u64_rem(now - tick_ns, NSEC_PER_SEC, &rem);
+    rtc_time64_to_tm(secs, &tm);
+
+    memset(&rt, 0, sizeof(rt));
+    rt.seconds  = secs;
+    rt.usec     = rem / NSEC_PER_USEC;
+    rt.error_us = error_us;
+    rt.year     = tm.tm_year + 1900;
+    rt.mon      = tm.tm_mon + 1;
+    rt.mday     = tm.tm_mday;
+    rt.hour     = tm.tm_hour;
+    rt.min      = tm.tm_min;
+    rt.sec      = tm.tm_sec;
+    rt.age_ns   = now - read_ns;
+
+    if (copy_to_user((void __user *)arg, &rt, sizeof(rt)))
+        return -EFAULT;
+    return 0;
+}
+
+/****************************************************************************************
+ * Netlink events
+ *
+ * Daemons that want every change, or the NMI events, join a multicast group of the
+ * MY_DEV_GENL_NAME generic netlink family instead of each keeping DEV_NAME or NMI_DEV_NAME
+ * open: one message reaches every listener, where the char devices cost a wakeup and a
+ * syscall per reader. Messages carry batches, an array attribute of fixed-size records, so
+ * a burst of changes is one message rather than one per byte.
+ *
+ * Nothing of this runs in the store path, which holds a bank lock with interrupts off:
+ * my_dev_shadow_set() only notes in hw_changed_bits where the change came from, next to the
+ * changed_bits it sets anyway. notify_work turns the offsets it collects into one message
+ * per run, taking the old value from genl_seen, its copy of what listeners last heard, and
+ * the new one from the shadow. Several changes of a byte between two runs become one
+ * record, and a byte changed and changed back none, so a burst costs one message however
+ * long it is, and there is nothing to drop. The NMI side is in the NMI event ring section.
+ ***************************************************************************************/
+
+static const struct genl_multicast_group my_dev_genl_mcgrps[] = {
+    [MY_DEV_GENL_GRP_CHANGE] = { .name = MY_DEV_GENL_MCGRP_CHANGE },
+    [MY_DEV_GENL_GRP_NMI]    = { .name = MY_DEV_GENL_MCGRP_NMI },
+};
+
+// Multicast only: no commands to send to the kernel
+static struct genl_family my_dev_genl_family = {
+    .name     = MY_DEV_GENL_NAME,
+    .version  = MY_DEV_GENL_VERSION,
+    .maxattr  = MY_DEV_GENL_A_MAX,
+    .module   = THIS_MODULE,
+    .mcgrps   = my_dev_genl_mcgrps,
+    .n_mcgrps = ARRAY_SIZE(my_dev_genl_mcgrps),
+};
+
+// A message of cmd with room for the u32 attributes and an array attribute of len bytes
+static struct sk_buff *my_dev_genl_new(uint8_t cmd, size_t len, void **hdr)
+{
+    struct sk_buff *skb = genlmsg_new(2 * nla_total_size(sizeof(u32)) + nla_total_size(len), GFP_KERNEL);
+
+    if (!skb)
+        return 0;
+
+    *hdr = genlmsg_put(skb, 0, 0, &my_dev_genl_family, 0, cmd);
+    if (!*hdr)
+    {
+        nlmsg_free(skb);
+        return 0;
+    }
+    return skb;
+}
+
+static void my_dev_genl_send(struct sk_buff *skb, void *hdr, unsigned int group)
+{
+    genlmsg_end(skb, hdr);
+    genlmsg_multicast(&my_dev_genl_family, skb, 0, group, GFP_KERNEL);    // -ESRCH: the last listener left
+}
+
+// From notify_work, with the offsets it collected. genl_seen follows the shadow whether or
+// not anybody listens, so a listener that joins later gets the right old values.
+static void my_dev_genl_changes(struct my_dev_inst *md, const unsigned long *changed)
+{
+    mydev_change_t *rec = 0;
+    struct sk_buff *skb;
+    void           *hdr;
+    unsigned int    addr, n = 0;
+
+    // No memory just means no message; genl_seen still has to keep up
+    if (genl_has_listeners(&my_dev_genl_family, &init_net, MY_DEV_GENL_GRP_CHANGE))
+        rec = kmalloc_array(bitmap_weight(changed, MY_DEV_NVRAM_SIZE), sizeof(*rec), GFP_KERNEL);
+
+    for_each_set_bit(addr, changed, MY_DEV_NVRAM_SIZE)
+    {
+        uint8_t val = READ_ONCE(md->page->nvram[addr]);
+
+        if (val == md->genl_seen[addr])
+            continue;
+        if (rec)
+        {
+            rec[n].offset = addr;
+            rec[n].old    = md->genl_seen[addr];
+            rec[n].val    = val;
+            rec[n].source = test_bit(addr, md->hw_changed_bits) ? MY_DEV_CHANGE_HW : MY_DEV_CHANGE_WRITE;
+            memset(rec[n].reserved, 0, sizeof(rec[n].reserved));
+            n++;
+        }
+        md->genl_seen[addr] = val;
+    }
+    if (n == 0)
+        goto out;
+
+    skb = my_dev_genl_new(MY_DEV_GENL_CMD_CHANGE, n * sizeof(*rec), &hdr);
+    if (!skb)
+        goto out;
+    if (nla_put_u32(skb, MY_DEV_GENL_A_INSTANCE, md->id) ||
+        nla_put(skb, MY_DEV_GENL_A_CHANGES, n * sizeof(*rec), rec))
+    {
+        nlmsg_free(skb);
+        goto out;
+    }
+    my_dev_genl_send(skb, hdr, MY_DEV_GENL_GRP_CHANGE);
+out:
+    kfree(rec);
+}
+
+/****************************************************************************************
+ * Change notification
+ *
+ * Every shadow update goes through my_dev_shadow_set(), which marks the offset in the
+ * instance's changed_bits when the value differs. notify_work then hands the changes to
+ * each open file of that instance whose MY_DEV_WATCH mask covers them and wakes its
+ * pollers with EPOLLPRI, and sysfs_notify()s the matching attribute files (which can
+ * sleep, hence the work). MY_DEV_CHANGES collects and clears what a watcher has pending.
+ *
+ * Changes made behind the driver's back (firmware, SMM, another OS agent) show up when the
+ * driver next reads the port. Loading with sample_ms set opts in to sample_work, which then
+ * reads every cached byte once per sample_ms; it is off by default because those port reads
+ * cost bus time and lock holds that nobody asked for.
+ * Bytes with a queued write-back are skipped, and the live RTC registers only report the
+ * changes the driver happens to see on a read someone asked for; rtc_work's own polling
+ * bypasses the shadow.
+ ***************************************************************************************/
+
+#define MY_DEV_SAMPLE_CHUNK 16    // bytes per lock hold, to bound the irq-off time
+
+// file->private_data of every open NVRAM file, which is how file operations find their instance
+struct my_dev_watcher {
+    struct list_head    node;
+    struct my_dev_inst *md;
+    DECLARE_BITMAP(mask, MY_DEV_NVRAM_SIZE);       // offsets subscribed to
+    DECLARE_BITMAP(pending, MY_DEV_NVRAM_SIZE);    // subscribed offsets changed since MY_DEV_CHANGES
+};
+
+static inline struct my_dev_inst *my_dev_file_inst(struct file *file)
+{
+    return ((struct my_dev_watcher *)file->private_data)->md;
+}
+
+static void my_dev_notify_fn(struct work_struct *work)
+{
+    struct my_dev_inst    *md = container_of(work, struct my_dev_inst, notify_work);
+    struct device         *dev;
+    DECLARE_BITMAP(changed, MY_DEV_NVRAM_SIZE);
+    struct my_dev_watcher *w;
+    bool                   wake = false;
+    int                    i;
+
+    for (i = 0; i < BITS_TO_LONGS(MY_DEV_NVRAM_SIZE); i++)
+        changed[i] = xchg(&md->changed_bits[i], 0);
+    if (bitmap_empty(changed, MY_DEV_NVRAM_SIZE))
+        return;
+
+    my_dev_genl_changes(md, changed);
+
+    spin_lock(&md->watch_lock);
+    list_for_each_entry(w, &md->watchers, node)
+    {
+        if (bitmap_intersects(changed, w->mask, MY_DEV_NVRAM_SIZE))
+        {
+            bitmap_or(w->pending, w->pending, changed, MY_DEV_NVRAM_SIZE);
+            bitmap_and(w->pending, w->pending, w->mask, MY_DEV_NVRAM_SIZE);
+            wake = true;
+        }
+    }
+    spin_unlock(&md->watch_lock);
+
+    if (wake)
+        wake_up_interruptible_poll(&md->watch_wq, EPOLLPRI);
+
+    dev = READ_ONCE(md->dev);
+    if (!dev)
+        return;
+    for (i = 0; i < ARRAY_SIZE(my_dev_attr_offsets); i++)
+        if (test_bit(my_dev_attr_offsets[i].offset, changed))
+            sysfs_notify(&dev->kobj, my_dev_attr_group.name, my_dev_attr_offsets[i].name);
+    sysfs_notify(&dev->kobj, my_dev_attr_group.name, "bank");
+}
+
+// Re-read every cached byte from the port, a chunk per lock hold; may sleep
+static void my_dev_resync(struct my_dev_inst *md)
+{
+    unsigned long flags;
+    unsigned int  addr, end, bank;
+
+    for (addr = MY_DEV_RTC_REGS; addr < MY_DEV_NVRAM_SIZE; addr = end)
+    {
+        // Chunks are aligned, so they never straddle the bank boundary
+        end   = min_t(unsigned int, round_up(addr + 1, MY_DEV_SAMPLE_CHUNK), MY_DEV_NVRAM_SIZE);
+        bank  = MY_DEV_BANK_BIT(addr);
+        flags = my_dev_lock_hw(md, bank);
+        for (; addr < end; addr++)
+            if (!test_bit(addr, md->dirty))
+                my_dev_hw_read(md, addr);
+        my_dev_unlock_hw(md, bank, flags);
+        cond_resched();
+    }
+}
+
+static void my_dev_sample_fn(struct work_struct *work)
+{
+    struct my_dev_inst *md = container_of(to_delayed_work(work), struct my_dev_inst, sample_work);
+
+    my_dev_resync(md);
+    schedule_delayed_work(&md->sample_work, msecs_to_jiffies(sample_ms));
+}
+
+static __poll_t my_dev_poll(struct file *file, poll_table *wait)
+{
+    struct my_dev_watcher *w = file->private_data;
+    __poll_t               mask = EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM;    // never blocks
+
+    poll_wait(file, &w->md->watch_wq, wait);
+
+    spin_lock(&w->md->watch_lock);
+    if (!bitmap_empty(w->pending, MY_DEV_NVRAM_SIZE))
+        mask |= EPOLLPRI;
+    spin_unlock(&w->md->watch_lock);
+    return mask;
+}
+
+// MY_DEV_WATCH replaces the subscription and drops pending changes outside it;
+// MY_DEV_CHANGES returns the pending changes and clears them
+static long my_dev_ioctl_watch(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct my_dev_watcher *w = file->private_data;
+    DECLARE_BITMAP(bits, MY_DEV_NVRAM_SIZE);
+    mydev_watch_t          watch;
+
+    if (cmd == MY_DEV_WATCH)
+    {
+        if (copy_from_user(&watch, (void __user *)arg, sizeof(watch)))
+            return -EFAULT;
+        bitmap_from_arr64(bits, watch.bits, MY_DEV_NVRAM_SIZE);
+
+        spin_lock(&w->md->watch_lock);
+        bitmap_copy(w->mask, bits, MY_DEV_NVRAM_SIZE);
+        bitmap_and(w->pending, w->pending, w->mask, MY_DEV_NVRAM_SIZE);
+        spin_unlock(&w->md->watch_lock);
+        return 0;
+    }
+
+    spin_lock(&w->md->watch_lock);
+    bitmap_copy(bits, w->pending, MY_DEV_NVRAM_SIZE);
+    bitmap_zero(w->pending, MY_DEV_NVRAM_SIZE);
+    spin_unlock(&w->md->watch_lock);
+
+    bitmap_to_arr64(watch.bits, bits, MY_DEV_NVRAM_SIZE);
+    if (copy_to_user((void __user *)arg, &watch, sizeof(watch)))
+        return -EFAULT;
+    return 0;
+}
+
+static void my_dev_stats_get(struct my_dev_inst *md, struct my_dev_stats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu)
+    {
+        struct my_dev_stats *st = per_cpu_ptr(md->stats, cpu);
+
+        sum->shadow_hits += READ_ONCE(st->shadow_hits);
+        sum->hw_reads    += READ_ONCE(st->hw_reads);
+        sum->wb_writes   += READ_ONCE(st->wb_writes);
+        sum->wb_elided   += READ_ONCE(st->wb_elided);
+    }
+}
+
+static ssize_t cache_hits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct my_dev_stats sum;
+
+    my_dev_stats_get(dev_get_drvdata(dev), &sum);
+    return sprintf(buf, "%llu\n", sum.shadow_hits);
+}
+
+static ssize_t cache_hw_reads_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct my_dev_stats sum;
+
+    my_dev_stats_get(dev_get_drvdata(dev), &sum);
+    return sprintf(buf, "%llu\n", sum.hw_reads);
+}
+
+static ssize_t wb_writes_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct my_dev_stats sum;
+
+    my_dev_stats_get(dev_get_drvdata(dev), &sum);
+    return sprintf(buf, "%llu\n", sum.wb_writes);
+}
+
+static ssize_t wb_elided_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct my_dev_stats sum;
+
+    my_dev_stats_get(dev_get_drvdata(dev), &sum);
+    return sprintf(buf, "%llu\n", sum.wb_elided);
+}
+
+/****************************************************************************************
+ * debugfs: /sys/kernel/debug/<device>/, one directory per instance (my-dev, my-dev1, ...)
+ *     counters  the cache and write-back counters, summed over CPUs
+ *     latency   per operation: count, average and a log2 histogram of the time taken
+ *     reset     write anything to zero all of the above
+ * Readers sum the per-CPU copies without stopping writers, so a line may be a few counts
+ * behind another, and a reset racing an update can leave a stray count behind.
+ ***************************************************************************************/
+
+static int my_dev_counters_show(struct seq_file *m, void *v)
+{
+    struct my_dev_stats sum;
+
+    my_dev_stats_get(m->private, &sum);
+    seq_printf(m, "shadow_hits %llu\n", sum.shadow_hits);
+    seq_printf(m, "hw_reads    %llu\n", sum.hw_reads);
+    seq_printf(m, "wb_writes   %llu\n", sum.wb_writes);
+    seq_printf(m, "wb_elided   %llu\n", sum.wb_elided);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_dev_counters);
+
+static void my_dev_hist_sum(struct my_dev_inst *md, enum my_dev_op op, struct my_dev_hist *sum)
+{
+    int cpu, b;
+
+    memset(sum, 0, sizeof(*sum));
+    for_each_possible_cpu(cpu)
+    {
+        struct my_dev_hist *h = &per_cpu_ptr(md->hist, cpu)->op[op];
+
+        sum->count    += READ_ONCE(h->count);
+        sum->total_ns += READ_ONCE(h->total_ns);
+        for (b = 0; b < MY_HIST_BUCKETS; b++)
+            sum->bucket[b] += READ_ONCE(h->bucket[b]);
+    }
+}
+
+static int my_dev_latency_show(struct seq_file *m, void *v)
+{
+    struct my_dev_inst *md = m->private;
+    struct my_dev_hist  sum;
+    int                 op, b;
+
+    for (op = 0; op < MY_OP_NR; op++)
+    {
+        my_dev_hist_sum(md, op, &sum);
+        if (!sum.count)
+            continue;
+
+        seq_printf(m, "%s: count %llu, avg %llu ns\n", my_dev_op_names[op], sum.count, div64_u64(sum.total_ns, sum.count));
+        for (b = 0; b < MY_HIST_BUCKETS; b++)
+            if (sum.bucket[b])
+                seq_printf(m, "    %10llu ns+ %llu\n", b ? 1ULL << b : 0, sum.bucket[b]);
+    }
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(my_dev_latency);
+
+static ssize_t my_dev_reset_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    struct my_dev_inst *md = file->private_data;
+    int                 cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        memset(per_cpu_ptr(md->stats, cpu), 0, sizeof(struct my_dev_stats));
+        memset(per_cpu_ptr(md->hist, cpu), 0, sizeof(struct my_dev_hists));
+    }
+    return count;
+}
+
+static const struct file_operations my_dev_reset_fops = {
+    .owner          = THIS_MODULE,
+    .open           = simple_open,
+    .write          = my_dev_reset_write,
+    .llseek         = noop_llseek,
+};
+
+// Failures are ignored: debugfs is a diagnostic aid, the driver works without it
+static void my_dev_debugfs_init(struct my_dev_inst *md)
+{
+    md->debugfs = debugfs_create_dir(dev_name(md->dev), NULL);
+    debugfs_create_file("counters", 0444, md->debugfs, md, &my_dev_counters_fops);
+    debugfs_create_file("latency",  0444, md->debugfs, md, &my_dev_latency_fops);
+    debugfs_create_file("reset",    0200, md->debugfs, md, &my_dev_reset_fops);
+}
+
+static ssize_t my_attr_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    struct my_dev_inst *md    = dev_get_drvdata(dev);
+    uint8_t             addr  = (uintptr_t)container_of(attr, struct dev_ext_attribute, attr)->var;
+    u64                 start = local_clock();
+    uint8_t             value = my_dev_read_byte(md, addr, false);
+
+    my_dev_hist_add(md, MY_OP_sysfs_show, start);
+    return sprintf(buf, "%hhx\n", value);
+}
+
+// Accepts decimal as before, and 0x-prefixed hex
+static ssize_t my_attr_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+    struct my_dev_inst *md    = dev_get_drvdata(dev);
+    uint8_t             addr  = (uintptr_t)container_of(attr, struct dev_ext_attribute, attr)->var;
+    u64                 start = local_clock();
+    uint8_t             value;
+    int                 ret;
+
+    ret = kstrtou8(buf, 0, &value);
+    if (ret)
+        return ret;
+
+    my_dev_write_byte(md, addr, value);
+    my_dev_hist_add(md, MY_OP_sysfs_store, start);
+    return count;
+}
+
+// Range read for read(), the bank attribute and friends; count > 0. One lock hold at most:
+// for everything when caching is off, otherwise only for live RTC registers in the range.
+static void my_dev_read_range(struct my_dev_inst *md, uint8_t *dst, loff_t pos, size_t count)
+{
+    unsigned long flags;
+    unsigned int  banks;
+    size_t        live = count;
+    size_t        i;
+
+    if (cache_reads)
+        live = (pos < MY_DEV_RTC_REGS) ? min_t(size_t, count, MY_DEV_RTC_REGS - pos) : 0;
+
+    if (live)
+    {
+        banks = my_dev_banks_of(pos, live);
+        flags = my_dev_lock_hw(md, banks);
+        for (i = 0; i < live; i++)
+            dst[i] = my_dev_hw_read(md, pos + i);
+        my_dev_unlock_hw(md, banks, flags);
+    }
+
+    if (count > live)
+        my_dev_shadow_copy(md, dst + live, pos + live, count - live);
+}
+
+// Range write for write() and my_dev_write_range0; count > 0. One lock hold.
+static void my_dev_write_range(struct my_dev_inst *md, const uint8_t *src, loff_t pos, size_t count)
+{
+    unsigned long flags;
+    unsigned int  banks = my_dev_banks_of(pos, count);
+    bool          csum = false;
+    size_t        i;
+
+    flags = my_dev_lock_hw(md, banks);
+    for (i = 0; i < count; i++)
+        csum |= my_dev_store_nosum(md, pos + i, src[i]);
+    if (csum)
+        my_dev_csum_refresh(md);    // the region changed, so its bank is held
+    my_dev_unlock_hw(md, banks, flags);
+}
+
+// sysfs already clipped pos/count to the attribute size
+static ssize_t bank_read(struct file *file, struct kobject *kobj, struct bin_attribute *attr, char *buf, loff_t pos, size_t count)
+{
+    struct my_dev_inst *md    = dev_get_drvdata(kobj_to_dev(kobj));
+    u64                 start = local_clock();
+
+    my_dev_read_range(md, buf, pos, count);
+    my_dev_hist_add(md, MY_OP_sysfs_bank, start);
+    return count;
+}
+
+static const struct file_operations my_dev_fops = {
+    .owner          = THIS_MODULE,
+    .llseek         = my_dev_llseek,
+    .read           = my_dev_read,
+    .write          = my_dev_write,
+    .poll           = my_dev_poll,
+    .unlocked_ioctl = my_dev_ioctl,
+    .uring_cmd      = my_dev_uring_cmd,
+    .mmap           = my_dev_mmap,
+    .fsync          = my_dev_fsync,
+    .open           = my_dev_open,
+    .release        = my_dev_release,
+};
+
+// /dev/my-dev reads and writes as a MY_DEV_NVRAM_SIZE byte file over both banks, so dd, cat and
+// pread/pwrite work. Every call moves its whole range under one lock hold, bounced through a
+// stack buffer because copy_{to,from}_user may fault and must not run under the lock.
+static loff_t my_dev_llseek(struct file *file, loff_t offset, int whence)
+{
+    return fixed_size_llseek(file, offset, whence, MY_DEV_NVRAM_SIZE);
+}
+
+static ssize_t my_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+{
+    struct my_dev_inst *md = my_dev_file_inst(file);
+    uint8_t             data[MY_DEV_NVRAM_SIZE];
+    loff_t              pos = *offset;
+    u64                 start = local_clock();
+
+    pr_debug("my_dev_read -- count:%ld, offset:%lld\n", count, pos);
+
+    if (pos < 0)
+        return -EINVAL;
+    if (pos >= MY_DEV_NVRAM_SIZE || count == 0)
+        return 0;           // Return 0 to indicate end of file
+
+    count = min_t(size_t, count, MY_DEV_NVRAM_SIZE - pos);
+
+    my_dev_read_range(md, data, pos, count);
+
+    if (copy_to_user(buf, data, count))
+    {
+        pr_info("my_dev_read -- error writing user output\n");
+        return -EFAULT;
+    }
+
+    *offset = pos + count;
+    my_dev_hist_add(md, MY_OP_read, start);
+    return count;
+}
+
+static ssize_t my_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+{
+    struct my_dev_inst *md = my_dev_file_inst(file);
+    uint8_t             data[MY_DEV_NVRAM_SIZE];
+    loff_t              pos = *offset;
+    u64                 start = local_clock();
+
+    pr_debug("my_dev_write -- count:%ld, offset:%lld\n", count, pos);
+
+    if (pos < 0)
+        return -EINVAL;
+    if (pos >= MY_DEV_NVRAM_SIZE || count == 0)
+        return 0;
+
+    if (!my_dev_writable(pos))
+        return -EINVAL;
+
+    count = min_t(size_t, count, MY_DEV_NVRAM_SIZE - pos);
+
+    if (copy_from_user(data, buf, count))
+    {
+        pr_info("my_dev_write -- error reading user input\n");
+        return -EFAULT;
+    }
+
+    my_dev_write_range(md, data, pos, count);
+
+    *offset = pos + count;
+    my_dev_hist_add(md, MY_OP_write, start);
+    return count;
+}
+
+// Run a batch of entries in kernel memory, all under a single lock hold; results go back into
+// the entries. Never sleeps. Shared by the vector ioctls, io_uring and my_dev_batch0.
+static int my_dev_vec_run(struct my_dev_inst *md, mydev_vec_entry_t *entries, uint32_t count)
+{
+    unsigned long flags;
+    uint32_t      i;
+    uint32_t      seq[MY_DEV_NUM_BANKS];
+    unsigned int  banks = 0;
+    bool          need_lock = !cache_reads;
+    bool          csum = false;
+
+    // Validate everything up front so a bad entry never leaves a batch half done
+    for (i = 0; i < count; i++)
+    {
+        if (entries[i].offset >= MY_DEV_NVRAM_SIZE || entries[i].op > MY_DEV_OP_TOGGLE_BITS)
+            return -EINVAL;
+        if (entries[i].op != MY_DEV_OP_READ && entries[i].op != MY_DEV_OP_READ_HW &&
+            !my_dev_writable(entries[i].offset))
+            return -EINVAL;
+        if (entries[i].op != MY_DEV_OP_READ || !my_dev_cacheable(entries[i].offset))
+            need_lock = true;
+        banks |= MY_DEV_BANK_BIT(entries[i].offset);
+    }
+
+    // A batch of plain cached reads is a lock-free consistent snapshot
+    if (!need_lock)
+    {
+        do
+        {
+            my_dev_read_begin(md, seq);
+            for (i = 0; i < count; i++)
+                entries[i].data = my_dev_shadow_read(md, entries[i].offset);
+        } while (my_dev_read_retry(md, seq));
+        return 0;
+    }
+
+    // Anything touching a port holds the locks of the banks involved for the whole batch
+    flags = my_dev_lock_hw(md, banks);
+    for (i = 0; i < count; i++)
+    {
+        switch (entries[i].op)
+        {
+            case MY_DEV_OP_READ:
+                if (my_dev_cacheable(entries[i].offset))
+                {
+                    entries[i].data = my_dev_shadow_read(md, entries[i].offset);
+                    break;
+                }
+                fallthrough;
+            case MY_DEV_OP_READ_HW:
+                entries[i].data = my_dev_hw_read(md, entries[i].offset);
+                break;
+            case MY_DEV_OP_WRITE:
+                csum |= my_dev_store_nosum(md, entries[i].offset, entries[i].data);
+                break;
+            case MY_DEV_OP_SET_BITS:
+            case MY_DEV_OP_CLEAR_BITS:
+            case MY_DEV_OP_TOGGLE_BITS:
+                entries[i].data = my_dev_rmw_locked(md, entries[i].op, entries[i].offset, entries[i].data, 0, 0);
+                break;
+        }
+    }
+    if (csum)
+        my_dev_csum_refresh(md);    // the region changed, so its bank is held
+    my_dev_unlock_hw(md, banks, flags);
+    return 0;
+}
+
+// Vectored request (MY_DEV_READV or MY_DEV_WRITEV): one copy in, one batch, one copy out.
+// Shared by the ioctl and io_uring paths; may sleep.
+static long my_dev_do_vec(struct my_dev_inst *md, unsigned int cmd, const mydev_vec_t *vec)
+{
+    mydev_vec_entry_t *entries;
+    long               ret;
+
+    if (vec->count == 0 || vec->count > MY_DEV_VEC_MAX)
+        return -EINVAL;
+
+    entries = memdup_user(u64_to_user_ptr(vec->entries), vec->count * sizeof(*entries));
+    if (IS_ERR(entries))
+        return PTR_ERR(entries);
+
+    ret = my_dev_vec_run(md, entries, vec->count);
+    if (ret == 0 && cmd == MY_DEV_READV &&
+        copy_to_user(u64_to_user_ptr(vec->entries), entries, vec->count * sizeof(*entries)))
+    {
+        pr_info("my_dev_do_vec -- error writing user output\n");
+        ret = -EFAULT;
+    }
+
+    kfree(entries);
+    return ret;
+}
+
+static long my_dev_ioctl_vec(struct my_dev_inst *md, unsigned int cmd, unsigned long arg)
+{
+    mydev_vec_t vec;
+
+    if( copy_from_user(&vec, (void __user *)arg, sizeof(vec)) )
+    {
+        pr_info("my_dev_ioctl_vec -- error reading user input\n");
+        return -EFAULT;
+    }
+    return my_dev_do_vec(md, cmd, &vec);
+}
+
+// MY_DEV_{SET,CLEAR,TOGGLE}_BITS or MY_DEV_CMPXCHG on a kernel copy of the argument; fills in old
+static int my_dev_do_rmw(struct my_dev_inst *md, unsigned int cmd, mydev_rmw_t *rmw)
+{
+    unsigned long flags;
+    uint8_t       op;
+
+    if (!my_dev_writable(rmw->offset))
+        return -EINVAL;
+
+    switch (cmd)
+    {
+        case MY_DEV_SET_BITS:    op = MY_DEV_OP_SET_BITS;    break;
+        case MY_DEV_CLEAR_BITS:  op = MY_DEV_OP_CLEAR_BITS;  break;
+        case MY_DEV_TOGGLE_BITS: op = MY_DEV_OP_TOGGLE_BITS; break;
+        default:                 op = MY_DEV_OP_CMPXCHG;     break;
+    }
+
+    flags    = my_dev_lock_hw(md, MY_DEV_BANK_BIT(rmw->offset));
+    rmw->old = my_dev_rmw_locked(md, op, rmw->offset, rmw->mask, rmw->expected, rmw->data);
+    my_dev_unlock_hw(md, MY_DEV_BANK_BIT(rmw->offset), flags);
+    return 0;
+}
+
+static long my_dev_ioctl_rmw(struct my_dev_inst *md, unsigned int cmd, unsigned long arg)
+{
+    mydev_rmw_t rmw;
+    int         ret;
+
+    if (copy_from_user(&rmw, (void __user *)arg, sizeof(rmw)))
+        return -EFAULT;
+
+    ret = my_dev_do_rmw(md, cmd, &rmw);
+    if (ret)
+        return ret;
+
+    if (copy_to_user((void __user *)arg, &rmw, sizeof(rmw)))
+        return -EFAULT;
+    return 0;
+}
+
+// MY_DEV_CSUM_SET validates and installs a region, fixing its checksum on request;
+// MY_DEV_CSUM_VERIFY returns it with the checksum recomputed over a copy of the shadow
+static long my_dev_ioctl_csum(struct my_dev_inst *md, unsigned int cmd, unsigned long arg)
+{
+    mydev_csum_t  cs;
+    uint8_t       nvram[MY_DEV_NVRAM_SIZE];
+    unsigned long flags;
+
+    if (cmd == MY_DEV_CSUM_VERIFY)
+    {
+        // Region and contents as of one instant; a memcpy under the locks is all it costs
+        flags = my_dev_lock_hw(md, MY_DEV_ALL_BANKS);
+        cs = md->csum;
+        memcpy(nvram, md->page->nvram, sizeof(nvram));
+        my_dev_unlock_hw(md, MY_DEV_ALL_BANKS, flags);
+
+        if (cs.alg == MY_DEV_CSUM_NONE)
+            return -ENODATA;
+        cs.computed = my_dev_csum_calc(&cs, nvram);
+        cs.stored   = my_dev_csum_get(&cs, nvram);
+
+        if (copy_to_user((void __user *)arg, &cs, sizeof(cs)))
+            return -EFAULT;
+        return 0;
+    }
+
+    if (copy_from_user(&cs, (void __user *)arg, sizeof(cs)))
+        return -EFAULT;
+    if (!my_dev_csum_valid(&cs))
+        return -EINVAL;
+    cs.computed = cs.stored = 0;
+
+    flags = my_dev_lock_hw(md, MY_DEV_ALL_BANKS);
+    md->csum = cs;
+    if (cs.alg != MY_DEV_CSUM_NONE && (cs.flags & MY_DEV_CSUM_F_FIX))
+        my_dev_csum_put(md, my_dev_csum_calc(&cs, md->page->nvram));
+    my_dev_unlock_hw(md, MY_DEV_ALL_BANKS, flags);
+    return 0;
+}
+
+/****************************************************************************************
+ * Named variables
+ *
+ * The directory layout is in cmos_dev.h. The index is an open-addressed hash table of
+ * record offsets, built from the shadow, so a lookup hashes the name and compares it with
+ * the record its slot points at: no directory scan. Any shadow change inside the area
+ * marks the index stale (my_dev_shadow_set), and the next operation rebuilds it, so a
+ * directory rewritten behind the driver's back, or through plain writes, is picked up.
+ * The operations here repair the index themselves where that is cheap: a value rewritten
+ * in place or a record appended. Deleting or resizing a record moves the ones after it
+ * down and rebuilds. New records are written body first and header last, so the directory
+ * never shows a half-written record; only the bytes that differ are written at all.
+ ***************************************************************************************/
+
+#define MY_KV_BANK              MY_DEV_BANK_BIT(MY_DEV_KV_BASE)
+#define MY_KV_NAME_LEN(hdr)     ((hdr) >> 4)
+#define MY_KV_VALUE_LEN(hdr)    ((hdr) & 0x0F)
+#define MY_KV_REC_LEN(hdr)      (1 + MY_KV_NAME_LEN(hdr) + MY_KV_VALUE_LEN(hdr))
+
+static inline const uint8_t *my_dev_kv_area(struct my_dev_inst *md)
+{
+    return &md->page->nvram[MY_DEV_KV_BASE];
+}
+
+// Slot of the record called name, or the empty slot where it would go
+static uint8_t *my_dev_kv_slot(struct my_dev_inst *md, const char *name, unsigned int len)
+{
+    const uint8_t *kv = my_dev_kv_area(md);
+    unsigned int   h  = jhash(name, len, 0);
+    unsigned int   i;
+
+    for (i = 0; i < MY_DEV_KV_SLOTS; i++, h++)
+    {
+        uint8_t *slot = &md->kv.slot[h & (MY_DEV_KV_SLOTS - 1)];
+
+        if (!*slot || (MY_KV_NAME_LEN(kv[*slot]) == len && !memcmp(&kv[*slot + 1], name, len)))
+            return slot;
+    }
+    return NULL;    // not reached: there are more slots than records
+}
+
+// Caller holds MY_KV_BANK. A record running past the area ends the directory; of two with
+// the same name the first one counts.
+static void my_dev_kv_build(struct my_dev_inst *md)
+{
+    const uint8_t *kv  = my_dev_kv_area(md);
+    unsigned int   pos = MY_DEV_KV_HDR_BYTES;
+
+    memset(md->kv.slot, 0, sizeof(md->kv.slot));
+    md->kv.stale     = false;
+    md->kv.formatted = kv[0] == MY_DEV_KV_MAGIC && kv[1] == MY_DEV_KV_VERSION;
+    md->kv.end       = pos;
+    if (!md->kv.formatted)
+        return;
+
+    while (pos < MY_DEV_KV_SIZE && MY_KV_NAME_LEN(kv[pos]) && pos + MY_KV_REC_LEN(kv[pos]) <= MY_DEV_KV_SIZE)
+    {
+        uint8_t *slot = my_dev_kv_slot(md, (const char *)&kv[pos + 1], MY_KV_NAME_LEN(kv[pos]));
+
+        if (!*slot)
+            *slot = pos;
+        pos += MY_KV_REC_LEN(kv[pos]);
+    }
+    md->kv.end = pos;
+}
+
+// Store one byte of the area if it differs; caller holds MY_KV_BANK
+static void my_dev_kv_put(struct my_dev_inst *md, unsigned int pos, uint8_t val)
+{
+    if (my_dev_kv_area(md)[pos] != val)
+        my_dev_store(md, MY_DEV_KV_BASE + pos, val);
+}
+
+// End the directory at end, unless it runs to the end of the area
+static void my_dev_kv_terminate(struct my_dev_inst *md, unsigned int end)
+{
+    if (end < MY_DEV_KV_SIZE)
+        my_dev_kv_put(md, end, 0);
+}
+
+static int my_dev_kv_get(struct my_dev_inst *md, mydev_kv_t *req, unsigned int nlen)
+{
+    const uint8_t *kv = my_dev_kv_area(md);
+    uint8_t       *slot;
+
+    if (!md->kv.formatted)
+        return -ENODATA;
+    slot = my_dev_kv_slot(md, req->name, nlen);
+    if (!*slot)
+        return -ENOENT;
+
+    req->len = MY_KV_VALUE_LEN(kv[*slot]);
+    memcpy(req->value, &kv[*slot + 1 + nlen], req->len);
+    return 0;
+}
+
+static int my_dev_kv_set(struct my_dev_inst *md, const mydev_kv_t *req, unsigned int nlen)
+{
+    const uint8_t *kv  = my_dev_kv_area(md);
+    unsigned int   end = md->kv.end;
+    unsigned int   pos, old_len, i;
+    uint8_t       *slot;
+
+    if (req->flags & MY_DEV_KV_F_FORMAT)
+    {
+        my_dev_kv_put(md, 0, MY_DEV_KV_MAGIC);
+        my_dev_kv_put(md, 1, MY_DEV_KV_VERSION);
+        my_dev_kv_terminate(md, MY_DEV_KV_HDR_BYTES);
+        my_dev_kv_build(md);
+        return 0;
+    }
+
+    if (!md->kv.formatted)
+        return -ENODATA;
+    slot = my_dev_kv_slot(md, req->name, nlen);
+
+    // Same size: the value in place, the index is unchanged
+    if (*slot && !(req->flags & MY_DEV_KV_F_DELETE) && MY_KV_VALUE_LEN(kv[*slot]) == req->len)
+    {
+        for (i = 0; i < req->len; i++)
+            my_dev_kv_put(md, *slot + 1 + nlen + i, req->value[i]);
+        md->kv.stale = false;
+        return 0;
+    }
+
+    if (!*slot && (req->flags & MY_DEV_KV_F_DELETE))
+        return -ENOENT;
+
+    old_len = *slot ? MY_KV_REC_LEN(kv[*slot]) : 0;
+    if (!(req->flags & MY_DEV_KV_F_DELETE) && end - old_len + 1 + nlen + req->len > MY_DEV_KV_SIZE)
+        return -ENOSPC;
+
+    // Delete or resize: close the gap, then append as for a new name
+    if (*slot)
+    {
+        for (pos = *slot; pos + old_len < end; pos++)
+            my_dev_kv_put(md, pos, kv[pos + old_len]);
+        end -= old_len;
+        my_dev_kv_terminate(md, end);
+        if (req->flags & MY_DEV_KV_F_DELETE)
+        {
+            my_dev_kv_build(md);
+            return 0;
+        }
+    }
+
+    pos = end;
+    for (i = 0; i < nlen; i++)
+        my_dev_kv_put(md, pos + 1 + i, req->name[i]);
+    for (i = 0; i < req->len; i++)
+        my_dev_kv_put(md, pos + 1 + nlen + i, req->value[i]);
+    my_dev_kv_terminate(md, pos + 1 + nlen + req->len);
+    my_dev_kv_put(md, pos, nlen << 4 | req->len);
+
+    if (old_len)
+        my_dev_kv_build(md);
+    else
+    {
+        *slot         = pos;
+        md->kv.end    = pos + 1 + nlen + req->len;
+        md->kv.stale  = false;
+    }
+    return 0;
+}
+
+static long my_dev_ioctl_kv(struct my_dev_inst *md, unsigned int cmd, unsigned long arg)
+{
+    mydev_kv_t    req;
+    unsigned long flags;
+    unsigned int  nlen;
+    int           ret;
+
+    if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+        return -EFAULT;
+
+    nlen = strnlen(req.name, sizeof(req.name));
+    if (!(cmd == MY_DEV_KV_SET && (req.flags & MY_DEV_KV_F_FORMAT)) &&
+        (nlen == 0 || nlen > MY_DEV_KV_NAME_MAX || req.len > MY_DEV_KV_VALUE_MAX))
+        return -EINVAL;
+
+    flags = my_dev_lock_hw(md, MY_KV_BANK);
+    if (md->kv.stale)
+        my_dev_kv_build(md);
+    ret = (cmd == MY_DEV_KV_GET) ? my_dev_kv_get(md, &req, nlen) : my_dev_kv_set(md, &req, nlen);
+    my_dev_unlock_hw(md, MY_KV_BANK, flags);
+
+    if (ret == 0 && cmd == MY_DEV_KV_GET && copy_to_user((void __user *)arg, &req, sizeof(req)))
+        return -EFAULT;
+    return ret;
+}
+
+// MY_DEV_SNAPSHOT and MY_DEV_RESTORE. A restore compares before it writes, against what a
+// read would return, so reprovisioning an already good image costs no port writes at all.
+// It holds a bank for at most MY_DEV_SAMPLE_CHUNK bytes at a time, like the sampler, so the
+// image lands in pieces rather than atomically.
+static long my_dev_ioctl_image(struct my_dev_inst *md, unsigned int cmd, unsigned long arg)
+{
+    DECLARE_BITMAP(mask, MY_DEV_NVRAM_SIZE);
+    mydev_image_t *img;
+    unsigned long  flags;
+    unsigned int   addr, end, bank;
+    bool           csum = false;
+    long           ret = 0;
+
+    img = memdup_user((void __user *)arg, sizeof(*img));
+    if (IS_ERR(img))
+        return PTR_ERR(img);
+    img->written = 0;
+
+    if (cmd == MY_DEV_SNAPSHOT)
+    {
+        if (img->flags & MY_DEV_IMAGE_F_HW)
+            my_dev_resync(md);
+        my_dev_read_range(md, img->data, 0, MY_DEV_NVRAM_SIZE);
+        // Everything RESTORE takes back, so a snapshot can be fed to it as it is
+        bitmap_zero(mask, MY_DEV_NVRAM_SIZE);
+        bitmap_set(mask, MY_DEV_RTC_REGS, MY_DEV_NVRAM_SIZE - MY_DEV_RTC_REGS);
+        bitmap_to_arr64(img->mask, mask, MY_DEV_NVRAM_SIZE);
+        goto out;
+    }
+
+    bitmap_from_arr64(mask, img->mask, MY_DEV_NVRAM_SIZE);
+    if (find_first_bit(mask, MY_DEV_NVRAM_SIZE) < MY_DEV_RTC_REGS)
+    {
+        ret = -EINVAL;
+        goto free;
+    }
+
+    for (addr = MY_DEV_RTC_REGS; addr < MY_DEV_NVRAM_SIZE; addr = end)
+    {
+        end   = min_t(unsigned int, round_up(addr + 1, MY_DEV_SAMPLE_CHUNK), MY_DEV_NVRAM_SIZE);
+        bank  = MY_DEV_BANK_BIT(addr);
+        flags = my_dev_lock_hw(md, bank);
+        for (; addr < end; addr++)
+        {
+            if (!test_bit(addr, mask) || my_dev_load(md, addr) == img->data[addr])
+                continue;
+            csum |= my_dev_store_nosum(md, addr, img->data[addr]);
+            img->written++;
+        }
+        my_dev_unlock_hw(md, bank, flags);
+        cond_resched();
+    }
+
+    // The region may have moved between chunks; all banks pin it
+    if (csum)
+    {
+        flags = my_dev_lock_hw(md, MY_DEV_ALL_BANKS);
+        my_dev_csum_refresh(md);
+        my_dev_unlock_hw(md, MY_DEV_ALL_BANKS, flags);
+    }
+
+out:
+    if (copy_to_user((void __user *)arg, img, sizeof(*img)))
+        ret = -EFAULT;
+free:
+    kfree(img);
+    return ret;
+}
+
+static long my_dev_ioctl_cmd(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    struct my_dev_inst *md = my_dev_file_inst(file);
+    mydev_data_t        mydev_data;
+
+    if (cmd == MY_DEV_READV || cmd == MY_DEV_WRITEV)
+        return my_dev_ioctl_vec(md, cmd, arg);
+
+    if (cmd == MY_DEV_SET_BITS || cmd == MY_DEV_CLEAR_BITS || cmd == MY_DEV_TOGGLE_BITS || cmd == MY_DEV_CMPXCHG)
+        return my_dev_ioctl_rmw(md, cmd, arg);
+
+    if (cmd == MY_DEV_RTC_TIME)
+        return my_dev_ioctl_rtc(md, arg);
+
+    if (cmd == MY_DEV_WATCH || cmd == MY_DEV_CHANGES)
+        return my_dev_ioctl_watch(file, cmd, arg);
+
+    if (cmd == MY_DEV_CSUM_SET || cmd == MY_DEV_CSUM_VERIFY)
+        return my_dev_ioctl_csum(md, cmd, arg);
+
+    if (cmd == MY_DEV_KV_GET || cmd == MY_DEV_KV_SET)
+        return my_dev_ioctl_kv(md, cmd, arg);
+
+    if (cmd == MY_DEV_SNAPSHOT || cmd == MY_DEV_RESTORE)
+        return my_dev_ioctl_image(md, cmd, arg);
+
+    if (cmd == MY_DEV_FLUSH)
+    {
+        my_dev_flush(md);
+        return 0;
+    }
+
+    // Anything else that isn't a single-byte command isn't ours, whatever arg points at
+    if (cmd != MY_DEV_READ && cmd != MY_DEV_READ_HW && cmd != MY_DEV_WRITE)
+        return -ENOTTY;
+
+    if( copy_from_user(&mydev_data, (void __user *)arg, sizeof(mydev_data)) )
+    {
+        pr_info("my_dev_ioctl -- error reading user input\n");
+        return -EFAULT;
+    }
+
+    trace_my_dev_ioctl(cmd, mydev_data.offset, mydev_data.data);
+
+    // The offset indexes the shadow as well as the port
+    if (mydev_data.offset >= MY_DEV_NVRAM_SIZE)
+        return -EINVAL;
+
+    switch(cmd)
+    {
+        case MY_DEV_READ:
+        case MY_DEV_READ_HW:
+            mydev_data.data = my_dev_read_byte(md, mydev_data.offset, cmd == MY_DEV_READ_HW);
+            if( copy_to_user((void __user *)arg, &mydev_data, sizeof(mydev_data)) )
+            {
+                pr_info("my_dev_ioctl -- error reading user input\n");
+                return -EFAULT;
+            }
+            break;
+
+        case MY_DEV_WRITE:
+            if (!my_dev_writable(mydev_data.offset))
+                return -EINVAL;
+            my_dev_write_byte(md, mydev_data.offset, mydev_data.data);
+            break;
 
-static DEFINE_RWLOCK(my_dev_lock);
-static struct class           *my_dev_class = 0;
-static struct device          *my_dev = 0;
+        default:
+            return -ENOTTY;
 
-static struct platform_device *mypdev = 0;
+    }
 
-static int my_dev_probe(struct platform_device *pdev);
-static int my_dev_remove(struct platform_device *pdev);
+    return 0;
+}
 
-static struct platform_driver my_dev_driver = {
-    .driver = {
-        .name  = DRV_NAME,
-        .owner = THIS_MODULE,
-    },
-    .probe     = my_dev_probe,
-    .remove    = my_dev_remove,
-};
+static long my_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+    u64  start = local_clock();
+    long ret   = my_dev_ioctl_cmd(file, cmd, arg);
 
-static int my_dev_major;
+    my_dev_hist_add(my_dev_file_inst(file), MY_OP_ioctl, start);
+    return ret;
+}
 
-static ssize_t my_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset);
-static ssize_t my_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset);
-static long    my_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg);
-static int     my_dev_open(struct inode *inode, struct file *file);
-static int     my_dev_release(struct inode *inode, struct file *file);
+/****************************************************************************************
+ * io_uring passthrough
+ *
+ * IORING_OP_URING_CMD with cmd_op set to an ioctl number and that ioctl's argument inline
+ * in the SQE, so one io_uring_enter() carries any number of operations. Single byte and RMW
+ * commands never sleep: they complete during submission and io_uring posts their CQEs as
+ * one batch when the submission ends. READV/WRITEV can fault on the entry array, so their
+ * nonblocking first attempt returns -EAGAIN and io_uring reissues them from a worker, with
+ * its own copy of the SQE.
+ ***************************************************************************************/
+
+static int my_dev_uring_cmd(struct io_uring_cmd *ioucmd, unsigned int issue_flags)
+{
+    struct my_dev_inst *md = my_dev_file_inst(ioucmd->file);
+    union {
+        mydev_data_t data;
+        mydev_rmw_t  rmw;
+        mydev_vec_t  vec;
+    } arg;
+    u64 start = local_clock();
+    int ret;
 
-static ssize_t my_attr_7f_show(struct device *dev, struct device_attribute *attr, char *buf);
-static ssize_t my_attr_7f_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
-static ssize_t my_attr_7e_show(struct device *dev, struct device_attribute *attr, char *buf);
-static ssize_t my_attr_7e_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
-static DEVICE_ATTR(my_attr_7f, 0644, my_attr_7f_show, my_attr_7f_store);
-static DEVICE_ATTR(my_attr_7e, 0644, my_attr_7e_show, my_attr_7e_store);
-static struct attribute *my_dev_attrs[] = {
-    &dev_attr_my_attr_7f.attr,
-    &dev_attr_my_attr_7e.attr,
-    NULL,
-};
-static struct attribute_group my_dev_attr_group = {
-    .attrs = my_dev_attrs,
-    .name  = "my-dev-attrs",
-};
+    BUILD_BUG_ON(sizeof(arg) > MY_DEV_URING_CMD_BYTES);
 
-static inline uint8_t ext_cmos_read(uint8_t addr)
-{
-    outb(addr, IO_RTC_BANK1_INDEX_PORT);
-    return inb(IO_RTC_BANK1_INDEX_PORT + 1);
+    // The SQE sits in memory user space can still write; read it exactly once
+    memcpy(&arg, ioucmd->cmd, sizeof(arg));
+
+    switch (ioucmd->cmd_op)
+    {
+        case MY_DEV_READ:
+        case MY_DEV_READ_HW:
+            if (arg.data.offset >= MY_DEV_NVRAM_SIZE)
+                return -EINVAL;
+            ret = my_dev_read_byte(md, arg.data.offset, ioucmd->cmd_op == MY_DEV_READ_HW);
+            break;
+
+        case MY_DEV_WRITE:
+            if (!my_dev_writable(arg.data.offset))
+                return -EINVAL;
+            my_dev_write_byte(md, arg.data.offset, arg.data.data);
+            ret = 0;
+            break;
+
+        case MY_DEV_SET_BITS:
+        case MY_DEV_CLEAR_BITS:
+        case MY_DEV_TOGGLE_BITS:
+        case MY_DEV_CMPXCHG:
+            ret = my_dev_do_rmw(md, ioucmd->cmd_op, &arg.rmw);
+            if (ret == 0)
+                ret = arg.rmw.old;
+            break;
+
+        case MY_DEV_READV:
+        case MY_DEV_WRITEV:
+            if (issue_flags & IO_URING_F_NONBLOCK)
+                return -EAGAIN;
+            ret = my_dev_do_vec(md, ioucmd->cmd_op, &arg.vec);
+            break;
+
+        default:
+            return -ENOTTY;
+    }
+
+    my_dev_hist_add(md, MY_OP_uring_cmd, start);
+    return ret;
 }
 
-static inline void ext_cmos_write(uint8_t addr, uint8_t val)
+// Map the shadow page read-only; user space polls it without any syscall
+static int my_dev_mmap(struct file *file, struct vm_area_struct *vma)
 {
-    outb(addr, IO_RTC_BANK1_INDEX_PORT);
-    outb(val, IO_RTC_BANK1_INDEX_PORT + 1);
+    struct my_dev_inst *md   = my_dev_file_inst(file);
+    unsigned long       size = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_pgoff != 0 || size > PAGE_SIZE)
+        return -EINVAL;
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+    vma->vm_flags &= ~VM_MAYWRITE;    // no mprotect(PROT_WRITE) later either
+
+    return remap_pfn_range(vma, vma->vm_start, virt_to_phys(md->page) >> PAGE_SHIFT, size, vma->vm_page_prot);
 }
 
-static ssize_t my_attr_7f_show(struct device *dev, struct device_attribute *attr, char *buf)
+// Durability point for write-back mode
+static int my_dev_fsync(struct file *file, loff_t start, loff_t end, int datasync)
 {
-    return sprintf(buf, "%hhx\n", ext_cmos_read(0x7F));
+    my_dev_flush(my_dev_file_inst(file));
+    return 0;
 }
 
-static ssize_t my_attr_7f_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
-{
-    long value;
-    if (kstrtol(buf, 10, &value) == -EINVAL)
-    {
-        pr_info("my_attr_7e_store -- buf:%s, count:%ld\n", buf, count);
-        return count;
-    }
+/****************************************************************************************
+ * NMI event ring
+ *
+ * my_nmi_test must not lock, sleep or printk, so each CPU gets its own ring of
+ * mydev_nmi_event_t. The NMI handler on that CPU is the only producer (NMIs do not nest).
+ * There are two consumers, each with its own tail and both serialized by
+ * my_nmi_read_lock: the reader of /dev/my-dev-nmi, and my_nmi_genl_work, which multicasts
+ * the events on the netlink nmi group. So head and tails need nothing more than
+ * acquire/release ordering. When a ring is full for either consumer the event is counted
+ * in dropped instead of overwriting one that consumer hasn't seen.
+ * Waking the reader is not NMI-safe either; irq_work defers it to interrupt context, and
+ * from there the netlink send to a work item. The netlink consumer keeps up even with no
+ * listeners, discarding, so it never holds the ring up; while it has listeners and nobody
+ * has /dev/my-dev-nmi open, it moves the reader's tail along too, so that netlink-only
+ * users don't see the ring fill up with events nobody will read.
+ * There is one NMI handler and one ring, registered with instance 0, whose shadow the
+ * events sample.
+ ***************************************************************************************/
+
+#define MY_NMI_RING_SIZE    64      // events per CPU, power of two
+#define MY_NMI_READ_MAX     64      // events handed out per read(), or per netlink message
+
+enum { MY_NMI_READER, MY_NMI_GENL, MY_NMI_CONSUMERS };
+
+struct my_nmi_ring {
+    unsigned int      head;                     // written only by the NMI handler of this CPU
+    unsigned int      tail[MY_NMI_CONSUMERS];   // written only by that consumer
+    unsigned long     dropped;
+    unsigned long     genl_dropped;             // dropped as of the last netlink message
+    mydev_nmi_event_t ev[MY_NMI_RING_SIZE];
+};
+static DEFINE_PER_CPU(struct my_nmi_ring, my_nmi_ring);
+static DECLARE_WAIT_QUEUE_HEAD(my_nmi_wq);
+static DEFINE_MUTEX(my_nmi_read_lock);
+static atomic_t my_nmi_readers;                 // open files of /dev/my-dev-nmi
+static struct irq_work my_nmi_work;
 
-    pr_info("my_attr_7f_store -- buf:%s, count:%ld, value:%ld\n", buf, count, value);
+static void my_nmi_genl_fn(struct work_struct *work);
+static DECLARE_WORK(my_nmi_genl_work, my_nmi_genl_fn);
 
-    ext_cmos_write(0x7F, (uint8_t)value);
-    return count;
+static void my_nmi_wakeup(struct irq_work *work)
+{
+    wake_up_interruptible(&my_nmi_wq);
+    schedule_work(&my_nmi_genl_work);
 }
 
-static ssize_t my_attr_7e_show(struct device *dev, struct device_attribute *attr, char *buf)
+static bool my_nmi_pending(void)
 {
-    return sprintf(buf, "%hhx\n", ext_cmos_read(0x7E));
+    int cpu;
+
+    for_each_possible_cpu(cpu)
+    {
+        struct my_nmi_ring *ring = per_cpu_ptr(&my_nmi_ring, cpu);
+
+        if (smp_load_acquire(&ring->head) != ring->tail[MY_NMI_READER])
+            return true;
+    }
+    return false;
 }
 
-static ssize_t my_attr_7e_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+// Caller holds my_nmi_read_lock; events come out grouped by CPU, ordered within a CPU
+static size_t my_nmi_drain(int consumer, mydev_nmi_event_t *out, size_t max)
 {
-    long value;
-    if (kstrtol(buf, 10, &value) == -EINVAL)
+    size_t n = 0;
+    int    cpu;
+
+    for_each_possible_cpu(cpu)
     {
-        pr_info("my_attr_7e_store -- buf:%s, count:%ld\n", buf, count);
-        return count;
-    }
+        struct my_nmi_ring *ring = per_cpu_ptr(&my_nmi_ring, cpu);
+        unsigned int        head = smp_load_acquire(&ring->head);
+        unsigned int        tail = ring->tail[consumer];
 
-    pr_info("my_attr_7e_store -- buf:%s, count:%ld, value:%ld\n", buf, count, value);
-    ext_cmos_write(0x7E, (uint8_t)value);
-    return count;
+        while (tail != head && n < max)
+            out[n++] = ring->ev[tail++ & (MY_NMI_RING_SIZE - 1)];
+        smp_store_release(&ring->tail[consumer], tail);    // slots may be reused from here on
+    }
+    return n;
 }
 
-static const struct file_operations my_dev_fops = {
-    .owner          = THIS_MODULE,
-    .read           = my_dev_read,
-    .write          = my_dev_write,
-    .unlocked_ioctl = my_dev_ioctl,
-    .open           = my_dev_open,
-    .release        = my_dev_release,
-};
-
-static ssize_t my_dev_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
+// Batches of up to MY_NMI_READ_MAX events to the netlink nmi group
+static void my_nmi_genl_fn(struct work_struct *work)
 {
-    uint8_t *data  = "My device read\n";
-    size_t datalen = strlen(data);
-    size_t ret     = 0;
-
-    pr_info("my_dev_read -- count:%ld, offset:%lld\n", count, *offset);
+    bool               listening = genl_has_listeners(&my_dev_genl_family, &init_net, MY_DEV_GENL_GRP_NMI);
+    mydev_nmi_event_t *events = 0;
+    struct sk_buff    *skb;
+    unsigned long      dropped = 0;
+    void              *hdr;
+    size_t             n;
+    int                cpu;
+
+    if (listening)
+        events = kmalloc_array(MY_NMI_READ_MAX, sizeof(*events), GFP_KERNEL);
+
+    mutex_lock(&my_nmi_read_lock);
+    for_each_possible_cpu(cpu)
+    {
+        struct my_nmi_ring *ring = per_cpu_ptr(&my_nmi_ring, cpu);
+        unsigned long       d    = READ_ONCE(ring->dropped);
 
-    if (count > datalen)
-        count = datalen;
+        dropped += d - ring->genl_dropped;
+        ring->genl_dropped = d;
+    }
 
-    if (*offset >= datalen)
-        ret = 0;           // Return 0 to indicate end of file
-    else
+    if (!events)
     {
-        if (copy_to_user(buf, data, count))
+        // Nobody to send to (or no memory): keep up without sending
+        for_each_possible_cpu(cpu)
         {
-            pr_info("my_dev_read -- error reading user input\n");
-            return -EFAULT;
+            struct my_nmi_ring *ring = per_cpu_ptr(&my_nmi_ring, cpu);
+
+            smp_store_release(&ring->tail[MY_NMI_GENL], smp_load_acquire(&ring->head));
         }
-        else
+        mutex_unlock(&my_nmi_read_lock);
+        return;
+    }
+
+    while ((n = my_nmi_drain(MY_NMI_GENL, events, MY_NMI_READ_MAX)) || dropped)
+    {
+        skb = my_dev_genl_new(MY_DEV_GENL_CMD_NMI, n * sizeof(*events), &hdr);
+        if (!skb)
+            break;
+        if ((dropped && nla_put_u32(skb, MY_DEV_GENL_A_DROPPED, dropped)) ||
+            (n && nla_put(skb, MY_DEV_GENL_A_NMI_EVENTS, n * sizeof(*events), events)))
         {
-            ret = count;
-            *offset += ret;
+            nlmsg_free(skb);
+            break;
         }
+        my_dev_genl_send(skb, hdr, MY_DEV_GENL_GRP_NMI);
+        dropped = 0;
     }
 
-    return ret;
+    // The events went out on netlink; don't let them pile up for a reader that isn't there
+    if (atomic_read(&my_nmi_readers) == 0)
+    {
+        for_each_possible_cpu(cpu)
+        {
+            struct my_nmi_ring *ring = per_cpu_ptr(&my_nmi_ring, cpu);
+            unsigned int        tail = ring->tail[MY_NMI_GENL];
+
+            if ((int)(tail - ring->tail[MY_NMI_READER]) > 0)
+                smp_store_release(&ring->tail[MY_NMI_READER], tail);
+        }
+    }
+    mutex_unlock(&my_nmi_read_lock);
+    kfree(events);
 }
 
-static ssize_t my_dev_write(struct file *file, const char __user *buf, size_t count, loff_t *offset)
+static ssize_t my_nmi_read(struct file *file, char __user *buf, size_t count, loff_t *offset)
 {
-    #define datalen  8
-    uint8_t databuf[datalen];
-    size_t  ret = 0;
+    mydev_nmi_event_t *events;
+    size_t             max = min_t(size_t, count / sizeof(*events), MY_NMI_READ_MAX);
+    size_t             n;
+    ssize_t            ret;
 
-    pr_info("my_dev_write -- count:%ld, offset:%lld\n", count, *offset);
+    if (max == 0)
+        return -EINVAL;
 
-    if (count > datalen)
-        count = datalen;
+    events = kmalloc_array(max, sizeof(*events), GFP_KERNEL);
+    if (!events)
+        return -ENOMEM;
 
-    if (*offset > datalen)
-        ret = 0;
-    else
+    for (;;)
     {
-        if (copy_from_user(databuf, buf, count))
+        mutex_lock(&my_nmi_read_lock);
+        n = my_nmi_drain(MY_NMI_READER, events, max);
+        mutex_unlock(&my_nmi_read_lock);
+        if (n)
+            break;
+
+        if (file->f_flags & O_NONBLOCK)
         {
-            pr_info("my_dev_write -- error reading user input\n");
-            return -EFAULT;
+            ret = -EAGAIN;
+            goto out;
         }
-        else
+        if (wait_event_interruptible(my_nmi_wq, my_nmi_pending()))
         {
-            ret = count;
-            *offset += ret;
+            ret = -ERESTARTSYS;
+            goto out;
         }
     }
 
-    // Expecting just one character and treating it as a command
-    switch(databuf[0])
-    {
-        case 'q':
-            pr_info("CMD q received\n");
-            // TODO: run the command
-            break;
-
-        default:
-            pr_info("CMD unknown\n");
-            break;
-    }
+    ret = n * sizeof(*events);
+    if (copy_to_user(buf, events, ret))
+        ret = -EFAULT;
 
+out:
+    kfree(events);
     return ret;
 }
 
-static long my_dev_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+static __poll_t my_nmi_poll(struct file *file, poll_table *wait)
+{
+    poll_wait(file, &my_nmi_wq, wait);
+    return my_nmi_pending() ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+static int my_nmi_release(struct inode *inode, struct file *file)
 {
-    mydev_data_t mydev_data;
+    atomic_dec(&my_nmi_readers);
+    return 0;
+}
 
-    if( copy_from_user(&mydev_data, (void __user *)arg, sizeof(mydev_data)) )
+static const struct file_operations my_nmi_fops = {
+    .owner          = THIS_MODULE,
+    .read           = my_nmi_read,
+    .poll           = my_nmi_poll,
+    .release        = my_nmi_release,
+    .llseek         = noop_llseek,
+};
+
+static ssize_t nmi_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+    unsigned long dropped = 0;
+    int           cpu;
+
+    for_each_possible_cpu(cpu)
+        dropped += READ_ONCE(per_cpu_ptr(&my_nmi_ring, cpu)->dropped);
+    return sprintf(buf, "%lu\n", dropped);
+}
+
+// Minor 0 is instance 0, minor 1 the NMI event stream, minor N + 1 instance N
+static unsigned int my_dev_minor(int id)
+{
+    return id ? id + 1 : 0;
+}
+
+static int my_dev_open(struct inode *inode, struct file *file)
+{
+    struct my_dev_watcher *w;
+    struct my_dev_inst    *md = 0;
+    unsigned int           minor = iminor(inode);
+    unsigned int           id = minor ? minor - 1 : 0;
+
+    trace_my_dev_open(inode, file);
+
+    if (minor == 1)
     {
-        pr_info("my_dev_ioctl -- error reading user input\n");
-        return -EFAULT;
+        replace_fops(file, &my_nmi_fops);
+        atomic_inc(&my_nmi_readers);
+        return 0;
     }
 
-    pr_info("my_dev_ioctl -- ioctl:%x, offset:%x, data:%x\n", cmd, mydev_data.offset, mydev_data.data);
+    // Every open file is a watcher, subscribed to nothing until MY_DEV_WATCH
+    w = kzalloc(sizeof(*w), GFP_KERNEL);
+    if (!w)
+        return -ENOMEM;
 
-    // TODO: sanity check the offset/address
-    switch(cmd)
+    mutex_lock(&my_dev_insts_lock);
+    if (id < MY_DEV_MAX_INSTANCES)
+        md = my_dev_insts[id];
+    if (md)
     {
-        case MY_DEV_READ:
-            read_lock(&my_dev_lock);
-            mydev_data.data = ext_cmos_read(mydev_data.offset);
-            read_unlock(&my_dev_lock);
-            if( copy_to_user((void __user *)arg, &mydev_data, sizeof(mydev_data)) )
-            {
-                pr_info("my_dev_ioctl -- error reading user input\n");
-                return -EFAULT;
-            }
-            break;
+        w->md = md;
+        spin_lock(&md->watch_lock);
+        list_add(&w->node, &md->watchers);
+        spin_unlock(&md->watch_lock);
+    }
+    mutex_unlock(&my_dev_insts_lock);
 
-        case MY_DEV_WRITE:
-            write_lock(&my_dev_lock);
-            ext_cmos_write(mydev_data.offset, mydev_data.data);
-            write_unlock(&my_dev_lock);
-            break;
+    if (!md)
+    {
+        kfree(w);
+        return -ENODEV;
+    }
+    file->private_data = w;
+    return 0;
+}
 
-        default:
-            pr_info("my_dev_ioctl -- unsupported ioctl: %d\n", cmd);
-            return -EFAULT;
+static int my_dev_release(struct inode *inode, struct file *file)
+{
+    struct my_dev_watcher *w = file->private_data;
 
-    }
+    trace_my_dev_release(inode, file);
 
+    spin_lock(&w->md->watch_lock);
+    list_del(&w->node);
+    spin_unlock(&w->md->watch_lock);
+    kfree(w);
     return 0;
 }
 
-static int my_dev_open(struct inode *inode, struct file *file)
+static void my_dev_free_page(struct my_dev_inst *md)
 {
-    pr_info("my_dev_open -- inode:%p, file:%p\n", inode, file);
-    return 0;
+    ClearPageReserved(virt_to_page(md->page));
+    free_page((unsigned long)md->page);
+    md->page = 0;
 }
 
-static int my_dev_release(struct inode *inode, struct file *file)
+static void my_dev_release_ports(struct device *dev, struct my_dev_inst *md)
 {
-    pr_info("my_dev_release -- inode:%p, file:%p\n", inode, file);
-    return 0;
+    if (md->be->needs_ports)
+        devm_release_region(dev, md->io_base, IO_RTC_NUM_PORTS / 2);
+}
+
+// Stop rtc_work for good and let a later probe take the RTC over
+static void my_dev_rtc_release(struct my_dev_inst *md)
+{
+    cancel_delayed_work_sync(&md->rtc_work);
+    if (!md->rtc_owner)
+        return;
+    mutex_lock(&my_dev_insts_lock);
+    my_dev_rtc_taken = false;
+    mutex_unlock(&my_dev_insts_lock);
+    md->rtc_owner = false;
+}
+
+static void my_dev_cancel_work(struct my_dev_inst *md)
+{
+    my_dev_rtc_release(md);
+    cancel_delayed_work_sync(&md->sample_work);
+    cancel_work_sync(&md->notify_work);
 }
 
 static int my_nmi_test(unsigned int val, struct pt_regs* regs);
 static int my_dev_probe(struct platform_device *pdev)
 {
-    int   retval;
-    dev_t dev;
+    struct my_dev_inst *md;
+    struct device      *dev;
+    int                 i;
+    unsigned long       flags;
+    char                name[16];
 
     pr_info("my_dev_probe -- pdev:%p\n", pdev);
 
-    if (!devm_request_region(&pdev->dev, IO_RTC_BANK1_INDEX_PORT, IO_RTC_NUM_PORTS / 2, dev_name(&pdev->dev))) {
-        dev_err(&pdev->dev, "Cannot get IO port at 0x%x for size of %d\n", IO_RTC_BANK1_INDEX_PORT, IO_RTC_NUM_PORTS / 2);
-        return -EBUSY;
+    md = devm_kzalloc(&pdev->dev, sizeof(*md), GFP_KERNEL);
+    if (!md)
+        return -ENOMEM;
+    // my_dev_init registers instance 0 without an id, so its names are the same as before
+    // there were several
+    md->id      = (pdev->id == PLATFORM_DEVID_NONE) ? 0 : pdev->id;
+    if (md->id >= nr_backend)
+        return -ENODEV;
+    md->io_base = (md->id < nr_io_base && io_base[md->id]) ? io_base[md->id] : IO_RTC_BANK1_INDEX_PORT;
+    md->devt    = MKDEV(my_dev_major, my_dev_minor(md->id));
+
+    for (i = 0; i < ARRAY_SIZE(my_dev_backends); i++)
+        if (sysfs_streq(backend[md->id], my_dev_backends[i].name))
+            break;
+    if (i == ARRAY_SIZE(my_dev_backends)) {
+        dev_err(&pdev->dev, "Unknown backend %s\n", backend[md->id]);
+        return -EINVAL;
     }
+    md->be = &my_dev_backends[i];
+    dev_info(&pdev->dev, "Using %s backend\n", md->be->name);
 
-    pr_info("My nmi handler: register");
-    register_nmi_handler(NMI_LOCAL, my_nmi_test, 0, "my_nmi_test");
+    md->stats = devm_alloc_percpu(&pdev->dev, struct my_dev_stats);
+    md->hist  = devm_alloc_percpu(&pdev->dev, struct my_dev_hists);
+    if (!md->stats || !md->hist)
+        return -ENOMEM;
 
-    // Passing 0 to major# so that system dynamically allocates one and return it
-    retval = register_chrdev(0, dev_name(&pdev->dev), &my_dev_fops);
-    if (retval < 0) {
-        dev_err(&pdev->dev, "Failed register_chrdev\n");
-        devm_release_region(&pdev->dev, IO_RTC_BANK1_INDEX_PORT, IO_RTC_NUM_PORTS / 2);
-        return retval;
+    for (i = 0; i < MY_DEV_NUM_BANKS; i++) {
+        spin_lock_init(&md->lock[i]);
+        md->bank_lock[i] = &md->lock[i];
     }
-    my_dev_major = retval;
-    dev = MKDEV(my_dev_major, 0);
-    // Create a struct class pointer to be used in calls to device_create()
-    my_dev_class = class_create(THIS_MODULE, "my-dev-class");
-    // Create char device in sysfs, registered to the specified class
-    my_dev = device_create(my_dev_class, NULL, dev, NULL, DEV_NAME);
+    if (md->be->needs_ports)
+        md->bank_lock[0] = &rtc_lock;
+    INIT_DELAYED_WORK(&md->wb_work, my_dev_wb_fn);
+    INIT_WORK(&md->notify_work, my_dev_notify_fn);
+    INIT_DELAYED_WORK(&md->sample_work, my_dev_sample_fn);
+    INIT_DELAYED_WORK(&md->rtc_work, my_dev_rtc_fn);
+    md->kv.stale = true;    // index built on first use
+    INIT_LIST_HEAD(&md->watchers);
+    spin_lock_init(&md->watch_lock);
+    init_waitqueue_head(&md->watch_wq);
+
+    // Only bank 1's ports are ours to claim; 0x70/0x71 belong to the RTC driver, and bank 0
+    // accesses share its rtc_lock instead
+    if (md->be->needs_ports &&
+        !devm_request_region(&pdev->dev, md->io_base, IO_RTC_NUM_PORTS / 2, dev_name(&pdev->dev))) {
+        dev_err(&pdev->dev, "Cannot get IO port at 0x%x for size of %d\n", md->io_base, IO_RTC_NUM_PORTS / 2);
+        return -EBUSY;
+    }
+
+    md->page = (mydev_shadow_page_t *)get_zeroed_page(GFP_KERNEL);
+    if (!md->page) {
+        my_dev_release_ports(&pdev->dev, md);
+        return -ENOMEM;
+    }
+    SetPageReserved(virt_to_page(md->page));    // remapped into user space by my_dev_mmap
+    md->page->size = MY_DEV_NVRAM_SIZE;
+
+    if (md->be->init)
+        md->be->init(md);
+
+    // Prime the shadow before anything can read through it; the live RTC registers are
+    // never served from it
+    flags = my_dev_lock_hw(md, MY_DEV_ALL_BANKS);
+    for (i = MY_DEV_RTC_REGS; i < MY_DEV_NVRAM_SIZE; i++)
+        my_dev_hw_read(md, i);
+    my_dev_unlock_hw(md, MY_DEV_ALL_BANKS, flags);
+
+    mutex_lock(&my_dev_insts_lock);
+    md->rtc_owner = md->be->needs_ports && !my_dev_rtc_taken;
+    if (md->rtc_owner)
+        my_dev_rtc_taken = true;
+    mutex_unlock(&my_dev_insts_lock);
+    if (md->rtc_owner)
+        schedule_delayed_work(&md->rtc_work, 0);
+    if (sample_ms)
+        schedule_delayed_work(&md->sample_work, msecs_to_jiffies(sample_ms));
+
+    // Create char device in sysfs, registered to the class my_dev_init created; its drvdata
+    // is how the sysfs handlers find the instance
+    if (md->id)
+        snprintf(name, sizeof(name), DEV_NAME "%d", md->id);
+    else
+        strscpy(name, DEV_NAME, sizeof(name));
+    // notify_work may already be queued by the priming above and reads md->dev unlocked, so
+    // it only ever sees NULL or a live device
+    dev = device_create(my_dev_class, NULL, md->devt, md, "%s", name);
+    if (IS_ERR(dev)) {
+        dev_err(&pdev->dev, "Failed device_create\n");
+        my_dev_cancel_work(md);
+        my_dev_free_page(md);
+        my_dev_release_ports(&pdev->dev, md);
+        return PTR_ERR(dev);
+    }
+    WRITE_ONCE(md->dev, dev);
+    platform_set_drvdata(pdev, md);
+
     // Add attributes to sys fs
-    sysfs_create_group(&my_dev->kobj, &my_dev_attr_group);
+    sysfs_create_group(&md->dev->kobj, &my_dev_attr_group);
+    my_dev_debugfs_init(md);
+
+    if (md->id == 0) {
+        pr_info("My nmi handler: register");
+        init_irq_work(&my_nmi_work, my_nmi_wakeup);
+        device_create(my_dev_class, NULL, MKDEV(my_dev_major, 1), NULL, NMI_DEV_NAME);
+    }
+
+    mutex_lock(&my_dev_insts_lock);
+    my_dev_insts[md->id] = md;
+    mutex_unlock(&my_dev_insts_lock);
+
+    // The handler reads instance 0 through my_dev_insts, so only now
+    if (md->id == 0)
+        register_nmi_handler(NMI_LOCAL, my_nmi_test, 0, "my_nmi_test");
 
     pr_info("my_dev_probe end\n");
     return 0;
@@ -362,58 +2724,119 @@ static int my_dev_probe(struct platform_device *pdev)
 
 static int my_dev_remove(struct platform_device *pdev)
 {
-    struct device *dev = &pdev->dev;
+    struct device      *dev = &pdev->dev;
+    struct my_dev_inst *md  = platform_get_drvdata(pdev);
 
     pr_info("my_dev_remove -- pdev:%p", pdev);
 
-    sysfs_remove_group(&my_dev->kobj, &my_dev_attr_group);
-    device_destroy(my_dev_class, MKDEV(my_dev_major, 0));
-    class_destroy(my_dev_class);
-    unregister_chrdev(my_dev_major, dev_name(dev));
+    if (md->id == 0) {
+        unregister_nmi_handler(NMI_LOCAL, "my_nmi_test");
+        irq_work_sync(&my_nmi_work);
+        cancel_work_sync(&my_nmi_genl_work);
+        device_destroy(my_dev_class, MKDEV(my_dev_major, 1));
+    }
 
-    unregister_nmi_handler(NMI_LOCAL, "my_nmi_test"); 
-    devm_release_region(dev, IO_RTC_BANK1_INDEX_PORT, IO_RTC_NUM_PORTS / 2);
+    // No new opens, and no new users of the exported API
+    mutex_lock(&my_dev_insts_lock);
+    my_dev_insts[md->id] = 0;
+    mutex_unlock(&my_dev_insts_lock);
+
+    cancel_delayed_work_sync(&md->sample_work);
+    debugfs_remove_recursive(md->debugfs);
+    sysfs_remove_group(&md->dev->kobj, &my_dev_attr_group);
+    WRITE_ONCE(md->dev, 0);            // notify_work stops notifying sysfs
+    cancel_work_sync(&md->notify_work);
+    device_destroy(my_dev_class, md->devt);
+
+    my_dev_rtc_release(md);
+    cancel_delayed_work_sync(&md->wb_work);
+    my_dev_flush(md);    // don't lose queued writes
+    cancel_work_sync(&md->notify_work);
+    my_dev_release_ports(dev, md);
+    my_dev_free_page(md);
     return 0;
 }
 
 static void cleanupPdev(void)
 {
-    if (mypdev) {
-        platform_device_put(mypdev);    // Free all memory associated with the platform device
-        platform_device_del(mypdev);    // Release all memory- and port-based resources owned by the device (@dev->resource)
-        mypdev = 0;
+    int i;
+
+    for (i = 0; i < MY_DEV_MAX_INSTANCES; i++) {
+        if (my_dev_pdevs[i]) {
+            platform_device_put(my_dev_pdevs[i]);    // Free all memory associated with the platform device
+            platform_device_del(my_dev_pdevs[i]);    // Release all memory- and port-based resources owned by the device (@dev->resource)
+            my_dev_pdevs[i] = 0;
+        }
     }
 }
 
 static int __init my_dev_init(void)
 {
     int ret;
+    int i;
 
     pr_info("my_dev_init\n");
- 
-    ret = platform_driver_register(&my_dev_driver);
-    if (ret) {
-        pr_err(DRV_NAME ": cannot register driver: %d\n", ret);
+
+    // One major for every instance; passing 0 so that the system dynamically allocates one
+    // and returns it
+    ret = register_chrdev(0, DRV_NAME, &my_dev_fops);
+    if (ret < 0) {
+        pr_err(DRV_NAME ": cannot register chrdev: %d\n", ret);
         return ret;
     }
+    my_dev_major = ret;
 
-    mypdev = platform_device_alloc(DRV_NAME, -1);         // DRV_NAME here causes my_dev_probe to be called
-    if (!mypdev) {
-        pr_err(DRV_NAME ": cannot allocate device\n");
-        platform_driver_unregister(&my_dev_driver);
-        return ENOMEM;
+    // Create a struct class pointer to be used in calls to device_create()
+    my_dev_class = class_create(THIS_MODULE, "my-dev-class");
+    if (IS_ERR(my_dev_class)) {
+        pr_err(DRV_NAME ": cannot create class\n");
+        unregister_chrdev(my_dev_major, DRV_NAME);
+        return PTR_ERR(my_dev_class);
     }
 
-    ret = platform_device_add(mypdev);
+    // Before any probe: my_dev_shadow_set asks the family for listeners
+    ret = genl_register_family(&my_dev_genl_family);
     if (ret) {
-        pr_err(DRV_NAME ": cannot register device\n");
-        platform_driver_unregister(&my_dev_driver);
-        cleanupPdev();
-        return ret;
+        pr_err(DRV_NAME ": cannot register netlink family: %d\n", ret);
+        goto err_class;
+    }
+
+    ret = platform_driver_register(&my_dev_driver);
+    if (ret) {
+        pr_err(DRV_NAME ": cannot register driver: %d\n", ret);
+        goto err_genl;
+    }
+
+    // One platform device per backend entry; DRV_NAME here causes my_dev_probe to be called
+    for (i = 0; i < nr_backend; i++) {
+        struct platform_device *pdev = platform_device_alloc(DRV_NAME, i ? i : PLATFORM_DEVID_NONE);
+
+        if (!pdev) {
+            pr_err(DRV_NAME ": cannot allocate device\n");
+            ret = -ENOMEM;
+            goto err_devices;
+        }
+        my_dev_pdevs[i] = pdev;
+
+        ret = platform_device_add(pdev);
+        if (ret) {
+            pr_err(DRV_NAME ": cannot register device %d\n", i);
+            goto err_devices;
+        }
     }
 
     pr_info("my_dev_init done\n");
     return 0;
+
+err_devices:
+    platform_driver_unregister(&my_dev_driver);
+    cleanupPdev();
+err_genl:
+    genl_unregister_family(&my_dev_genl_family);
+err_class:
+    class_destroy(my_dev_class);
+    unregister_chrdev(my_dev_major, DRV_NAME);
+    return ret;
 }
 
 static void __exit my_dev_exit(void)
@@ -421,6 +2844,9 @@ static void __exit my_dev_exit(void)
     pr_info("my_dev_exit\n");
     platform_driver_unregister(&my_dev_driver);
     cleanupPdev();
+    genl_unregister_family(&my_dev_genl_family);
+    class_destroy(my_dev_class);
+    unregister_chrdev(my_dev_major, DRV_NAME);
 }
 
 module_init(my_dev_init);
@@ -431,27 +2857,193 @@ MODULE_VERSION("0.1");
 MODULE_DESCRIPTION("Example CMOS DEV driver");
 MODULE_AUTHOR("dyulu <dyulu@example.com>");
 
+// The exported API works on instance 0, the one at the legacy ports. Before it is probed,
+// or after it is removed, reads return 0xFF like an absent port and writes are dropped.
+static struct my_dev_inst *my_dev_inst0(void)
+{
+    return READ_ONCE(my_dev_insts[0]);
+}
+
+// Offsets are in the unified space (bank 1 starts at MY_DEV_BANK1_BASE) and wrap within it
 uint8_t my_dev_read0(uint16_t offset)
 {
-    uint8_t data;
-    read_lock(&my_dev_lock);
-    data = ext_cmos_read(offset);
-    read_unlock(&my_dev_lock);
+    struct my_dev_inst *md = my_dev_inst0();
+    u64                 start = local_clock();
+    uint8_t             data;
+
+    if (!md)
+        return 0xFF;
+    data = my_dev_read_byte(md, offset & (MY_DEV_NVRAM_SIZE - 1), false);
+    my_dev_hist_add(md, MY_OP_read0, start);
     return data;
 }
 EXPORT_SYMBOL_GPL(my_dev_read0);    // Only modules that declare a GPL-compatible license will be able to see the symbol
 
 void my_dev_write0(uint16_t offset, uint8_t data)
 {
-    write_lock(&my_dev_lock);
-    ext_cmos_write(offset, data);
-    write_unlock(&my_dev_lock);
+    struct my_dev_inst *md = my_dev_inst0();
+    u64                 start = local_clock();
+
+    offset &= MY_DEV_NVRAM_SIZE - 1;
+    if (!md || !my_dev_writable(offset))
+        return;
+    my_dev_write_byte(md, offset, data);
+    my_dev_hist_add(md, MY_OP_write0, start);
 }
 EXPORT_SYMBOL_GPL(my_dev_write0);
 
+// Bulk variants. Ranges must lie inside the unified space; they don't wrap. Each call takes
+// the bank locks at most once, with interrupts off, so they may be called from any context
+// but NMI; see my_dev_batch0 for the limit on how long that lasts. -ENODEV without instance 0.
+static bool my_dev_range_ok(uint16_t offset, size_t count)
+{
+    return offset < MY_DEV_NVRAM_SIZE && count <= MY_DEV_NVRAM_SIZE - offset;
+}
+
+int my_dev_read_range0(uint16_t offset, uint8_t *buf, size_t count)
+{
+    struct my_dev_inst *md = my_dev_inst0();
+    u64                 start = local_clock();
+
+    if (!md)
+        return -ENODEV;
+    if (!my_dev_range_ok(offset, count))
+        return -EINVAL;
+    if (count)
+        my_dev_read_range(md, buf, offset, count);
+    my_dev_hist_add(md, MY_OP_bulk0, start);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(my_dev_read_range0);
+
+int my_dev_write_range0(uint16_t offset, const uint8_t *buf, size_t count)
+{
+    struct my_dev_inst *md = my_dev_inst0();
+    u64                 start = local_clock();
+
+    if (!md)
+        return -ENODEV;
+    if (!my_dev_range_ok(offset, count) || !my_dev_writable(offset))
+        return -EINVAL;
+    if (count)
+        my_dev_write_range(md, buf, offset, count);
+    my_dev_hist_add(md, MY_OP_bulk0, start);
+    return 0;
+}
+EXPORT_SYMBOL_GPL(my_dev_write_range0);
+
+// Scatter/gather: entries as for MY_DEV_READV, any mix of ops, at most MY_DEV_VEC_MAX of them.
+// Results are written back into the entries.
+int my_dev_batch0(mydev_vec_entry_t *entries, size_t count)
+{
+    struct my_dev_inst *md = my_dev_inst0();
+    u64                 start = local_clock();
+    int                 ret;
+
+    if (!md)
+        return -ENODEV;
+    if (count > MY_DEV_VEC_MAX)
+        return -EINVAL;
+    if (count == 0)
+        return 0;
+
+    ret = my_dev_vec_run(md, entries, count);
+    my_dev_hist_add(md, MY_OP_bulk0, start);
+    return ret;
+}
+EXPORT_SYMBOL_GPL(my_dev_batch0);
+
+// Shadow only, whatever cache_reads says, and it never waits for a writer: safe in NMI
+// context. -EAGAIN means a writer was active on every attempt (in NMI context, possibly the
+// very code the NMI interrupted); buf then holds a copy that may mix old and new bytes.
+// The RTC registers 0x00-0x0D read as of the last time the driver went to the port.
+#define MY_DEV_CACHED_TRIES 3
+
+static int my_dev_cached_copy(struct my_dev_inst *md, uint16_t offset, uint8_t *buf, size_t count)
+{
+    uint32_t seq[MY_DEV_NUM_BANKS];
+    bool     busy;
+    int      tries, b;
+
+    for (tries = 0; tries < MY_DEV_CACHED_TRIES; tries++)
+    {
+        busy = false;
+        for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+        {
+            seq[b] = smp_load_acquire(&md->page->seq[b]);
+            busy  |= seq[b] & 1;
+        }
+        memcpy(buf, &md->page->nvram[offset], count);
+        if (!busy && !my_dev_read_retry(md, seq))
+            return 0;
+    }
+    return -EAGAIN;
+}
+
+int my_dev_read_cached0(uint16_t offset, uint8_t *buf, size_t count)
+{
+    struct my_dev_inst *md = my_dev_inst0();
+
+    if (!md)
+        return -ENODEV;
+    if (!my_dev_range_ok(offset, count))
+        return -EINVAL;
+    return my_dev_cached_copy(md, offset, buf, count);
+}
+EXPORT_SYMBOL_GPL(my_dev_read_cached0);
+
+// The lock_wait_* and lock_hold_* histograms of debugfs latency, for modules that measure
+// the driver's locking from outside; callers diff two snapshots around what they measure
+static void my_dev_lock_hist_copy(struct my_dev_inst *md, enum my_dev_op op, struct my_dev_lock_hist *out)
+{
+    struct my_dev_hist sum;
+
+    BUILD_BUG_ON(MY_HIST_BUCKETS != MY_DEV_LOCK_HIST_BUCKETS);
+    my_dev_hist_sum(md, op, &sum);
+    out->count    = sum.count;
+    out->total_ns = sum.total_ns;
+    memcpy(out->bucket, sum.bucket, sizeof(out->bucket));
+}
+
+int my_dev_lock_stats0(struct my_dev_lock_stats *stats)
+{
+    struct my_dev_inst *md = my_dev_inst0();
+    int                 b;
+
+    if (!md)
+        return -ENODEV;
+    for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+    {
+        my_dev_lock_hist_copy(md, MY_OP_lock_wait_bank0 + b, &stats->wait[b]);
+        my_dev_lock_hist_copy(md, MY_OP_lock_hold_bank0 + b, &stats->hold[b]);
+    }
+    return 0;
+}
+EXPORT_SYMBOL_GPL(my_dev_lock_stats0);
+
+// NMI context: shadow bytes only, no port access, no lock, no printk
 static int my_nmi_test(unsigned int val, struct pt_regs* regs)
 {
-    pr_info("My nmi_test, addr 0x7F:x%02hhx, addr 0x7E:x%02hhx, addr 0x7D:x%02hhx\n",  my_dev_read0(0x7F), my_dev_read0(0x7E), my_dev_read0(0x7D));
+    struct my_nmi_ring *ring = this_cpu_ptr(&my_nmi_ring);
+    unsigned int        head = ring->head;
+    mydev_nmi_event_t  *ev;
+    int                 c;
+
+    for (c = 0; c < MY_NMI_CONSUMERS; c++)
+    {
+        if (head - smp_load_acquire(&ring->tail[c]) >= MY_NMI_RING_SIZE)
+        {
+            ring->dropped++;
+            return NMI_DONE;
+        }
+    }
+
+    ev = &ring->ev[head & (MY_NMI_RING_SIZE - 1)];
+    ev->timestamp_ns = ktime_get_mono_fast_ns();
+    ev->cpu          = smp_processor_id();
+    my_dev_read_cached0(MY_DEV_NMI_OFFSET, ev->data, MY_DEV_NMI_BYTES);    // -EAGAIN: keep the torn copy
+    smp_store_release(&ring->head, head + 1);
+
+    irq_work_queue(&my_nmi_work);
     return NMI_DONE;         // NMI_HANDLED;
 }
-
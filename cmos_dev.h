@@ -9,7 +9,293 @@ typedef struct mydev_data
     uint32_t offset;
 } mydev_data_t;
 
+// Offsets are in one 256-byte space covering both CMOS banks:
+//     0x00-0x7F  bank 0, RTC + NVRAM through ports 0x70/0x71
+//     0x80-0xFF  bank 1, extended NVRAM through ports 0x72/0x73 (index = offset - 0x80)
+// Bank 0 offsets below MY_DEV_RTC_REGS are live RTC registers and are never cached. They are
+// read-only here: every write path (write(), MY_DEV_WRITE, the bit ops, MY_DEV_WRITEV, io_uring,
+// MY_DEV_RESTORE) fails with -EINVAL when it would store to one. Status register C clears the
+// RTC interrupt flags when read, so the driver never reads it (reads 0).
+#define MY_DEV_BANK_SIZE   128
+#define MY_DEV_NUM_BANKS   2
+#define MY_DEV_NVRAM_SIZE  (MY_DEV_NUM_BANKS * MY_DEV_BANK_SIZE)
+#define MY_DEV_BANK1_BASE  0x80
+#define MY_DEV_RTC_REGS    0x0E
+#define MY_DEV_RTC_REG_C   0x0C
+
+// One entry of a vectored request; op selects what is done at offset
+#define MY_DEV_OP_READ    0
+#define MY_DEV_OP_WRITE   1
+#define MY_DEV_OP_READ_HW 2    // bypass the driver's shadow and re-read the port
+#define MY_DEV_OP_SET_BITS    3    // data |= mask
+#define MY_DEV_OP_CLEAR_BITS  4    // data &= ~mask
+#define MY_DEV_OP_TOGGLE_BITS 5    // data ^= mask
+#define MY_DEV_OP_CMPXCHG     6    // data = new if data == expected (mydev_rmw_t only)
+
+typedef struct mydev_vec_entry
+{
+    uint32_t offset;
+    uint8_t  data;       // value to write, or value read back
+    uint8_t  op;         // MY_DEV_OP_*
+    uint16_t reserved;
+} mydev_vec_entry_t;
+
+// In a vector, the bit ops take the mask in data and hand back the prior value in data
+
+// entries is a user pointer to count mydev_vec_entry_t, kept 64-bit for 32-bit user space
+typedef struct mydev_vec
+{
+    uint64_t entries;
+    uint32_t count;
+    uint32_t reserved;
+} mydev_vec_t;
+
+#define MY_DEV_VEC_MAX    256    // max entries per vectored ioctl
+
+// Atomic read-modify-write of one byte, done under a single lock hold. old returns the
+// value before the operation; for CMPXCHG the store happened iff old == expected.
+typedef struct mydev_rmw
+{
+    uint32_t offset;
+    uint8_t  mask;        // SET/CLEAR/TOGGLE_BITS: bits to change
+    uint8_t  expected;    // CMPXCHG: value the byte must hold
+    uint8_t  data;        // CMPXCHG: value stored on a match
+    uint8_t  old;         // out: prior value
+} mydev_rmw_t;
+
+// Read-only page mapped by mmap() on the device. seq[b] is odd while the driver updates bank b;
+// copy nvram out and retry if a seq of a bank you copied from was odd or changed meanwhile.
+typedef struct mydev_shadow_page
+{
+    uint32_t seq[MY_DEV_NUM_BANKS];
+    uint32_t size;       // valid bytes in nvram
+    uint32_t reserved;
+    uint8_t  nvram[MY_DEV_NVRAM_SIZE];
+} mydev_shadow_page_t;
+
+// Record written by the NMI handler and drained by reading NMI_DEV_NAME. data holds the
+// shadow bytes MY_DEV_NMI_OFFSET .. MY_DEV_NMI_OFFSET + MY_DEV_NMI_BYTES - 1.
+#define MY_DEV_NMI_OFFSET 0xFD    // bank 1 bytes 0x7D-0x7F
+#define MY_DEV_NMI_BYTES  3
+
+typedef struct mydev_nmi_event
+{
+    uint64_t timestamp_ns;    // CLOCK_MONOTONIC
+    uint32_t cpu;
+    uint8_t  data[MY_DEV_NMI_BYTES];
+    uint8_t  reserved;
+} mydev_nmi_event_t;
+
+// Generic netlink family MY_DEV_GENL_NAME multicasts NVRAM changes and NMI events, so any number
+// of daemons can follow them without opening DEV_NAME or NMI_DEV_NAME. Resolve the family and
+// its groups by name through nlctrl, join a group, and each message then carries a batch:
+//     MY_DEV_GENL_CMD_CHANGE, group MY_DEV_GENL_MCGRP_CHANGE
+//         A_INSTANCE  u32, the instance the changes happened on (0 is DEV_NAME)
+//         A_CHANGES   array of mydev_change_t, by offset
+//     MY_DEV_GENL_CMD_NMI, group MY_DEV_GENL_MCGRP_NMI
+//         A_NMI_EVENTS array of mydev_nmi_event_t, as read from NMI_DEV_NAME
+//         A_DROPPED   u32, events lost since the last message; present only when non-zero
+// Changes are coalesced per offset between messages: a byte written several times in quick
+// succession comes as one record from the value last reported to the latest one.
+#define MY_DEV_GENL_NAME          "my_dev"
+#define MY_DEV_GENL_VERSION       1
+#define MY_DEV_GENL_MCGRP_CHANGE  "change"
+#define MY_DEV_GENL_MCGRP_NMI     "nmi"
+
+enum
+{
+    MY_DEV_GENL_CMD_UNSPEC,
+    MY_DEV_GENL_CMD_CHANGE,
+    MY_DEV_GENL_CMD_NMI,
+};
+
+enum
+{
+    MY_DEV_GENL_A_UNSPEC,
+    MY_DEV_GENL_A_INSTANCE,
+    MY_DEV_GENL_A_CHANGES,
+    MY_DEV_GENL_A_NMI_EVENTS,
+    MY_DEV_GENL_A_DROPPED,
+    __MY_DEV_GENL_A_MAX,
+};
+#define MY_DEV_GENL_A_MAX (__MY_DEV_GENL_A_MAX - 1)
+
+#define MY_DEV_CHANGE_WRITE  0    // written through the driver, by any interface
+#define MY_DEV_CHANGE_HW     1    // found on the port: changed behind the driver's back, or first read at probe
+
+typedef struct mydev_change
+{
+    uint16_t offset;
+    uint8_t  old;
+    uint8_t  val;
+    uint8_t  source;      // MY_DEV_CHANGE_*, of the latest change
+    uint8_t  reserved[3];
+} mydev_change_t;
+
+// RTC time served from a snapshot the driver refreshes once per RTC update cycle, so callers
+// never wait out Update-In-Progress on the ports. The driver times the RTC's second tick and
+// extrapolates from it with CLOCK_MONOTONIC; error_us bounds how well the tick was timed
+// (MY_DEV_RTC_UNSYNCED when it could not be, e.g. a stopped clock: then only the second is good).
+#define MY_DEV_RTC_UNSYNCED 1000000
+
+typedef struct mydev_rtc_time
+{
+    int64_t  seconds;     // seconds since the epoch, taking the RTC to run in UTC
+    uint32_t usec;        // microseconds into that second
+    uint32_t error_us;
+    uint16_t year;        // e.g. 2024
+    uint8_t  mon;         // 1-12
+    uint8_t  mday;        // 1-31
+    uint8_t  hour;        // 0-23
+    uint8_t  min;
+    uint8_t  sec;
+    uint8_t  reserved;
+    uint64_t age_ns;      // time since the driver took the snapshot this was extrapolated from
+} mydev_rtc_time_t;
+
+// Offset bitmap for MY_DEV_WATCH and MY_DEV_CHANGES: bit (n % 64) of bits[n / 64] is offset n
+typedef struct mydev_watch
+{
+    uint64_t bits[MY_DEV_NVRAM_SIZE / 64];
+} mydev_watch_t;
+
+// Checksum region: the bytes start..end (inclusive) are summed into a checksum stored at
+// offset, which every write through the driver keeps current by taking the old byte out and
+// adding the new one in, with no port reads. The 16 bit sums take offset and offset + 1.
+// Region and checksum must sit in one bank, above the RTC registers, with the checksum after
+// the region. Writes of several bytes (write(), MY_DEV_WRITEV, MY_DEV_RESTORE) may include the
+// checksum; the driver recomputes it from the region once they are done.
+// The PC/AT layout is start 0x10, end 0x2D, offset 0x2E, MY_DEV_CSUM_SUM16_BE.
+#define MY_DEV_CSUM_NONE        0    // MY_DEV_CSUM_SET: turn checksum upkeep off
+#define MY_DEV_CSUM_SUM8        1    // 8 bit sum
+#define MY_DEV_CSUM_SUM16_BE    2    // 16 bit sum, most significant byte at offset
+#define MY_DEV_CSUM_SUM16_LE    3    // 16 bit sum, least significant byte at offset
+#define MY_DEV_CSUM_XOR8        4    // 8 bit xor
+
+#define MY_DEV_CSUM_F_FIX       0x01 // MY_DEV_CSUM_SET: also rewrite the checksum to match the region now
+
+typedef struct mydev_csum
+{
+    uint8_t  alg;         // MY_DEV_CSUM_*
+    uint8_t  flags;       // MY_DEV_CSUM_F_*
+    uint16_t start;
+    uint16_t end;
+    uint16_t offset;      // where the checksum is stored
+    uint16_t computed;    // MY_DEV_CSUM_VERIFY: checksum of the region as the shadow holds it
+    uint16_t stored;      // MY_DEV_CSUM_VERIFY: checksum found at offset
+} mydev_csum_t;
+
+// Named variables, kept in a directory at the start of bank 1 instead of at fixed offsets that
+// every tool has to agree on. On NVRAM, from MY_DEV_KV_BASE:
+//     byte 0     MY_DEV_KV_MAGIC
+//     byte 1     MY_DEV_KV_VERSION
+//     byte 2...  records, packed: a header byte (name length << 4 | value length), the name
+//                (1-15 bytes, no NUL), the value (0-15 bytes); a 0x00 header or the end of the
+//                area ends the directory
+// The driver indexes the directory by name hash, so MY_DEV_KV_GET and MY_DEV_KV_SET cost the
+// same however many variables there are.
+#define MY_DEV_KV_BASE          MY_DEV_BANK1_BASE
+#define MY_DEV_KV_SIZE          0x70    // bank 1 bytes 0x00-0x6F; 0x70-0x7F stay for fixed offsets
+#define MY_DEV_KV_MAGIC         0xC5
+#define MY_DEV_KV_VERSION       1
+#define MY_DEV_KV_HDR_BYTES     2
+#define MY_DEV_KV_NAME_MAX      15
+#define MY_DEV_KV_VALUE_MAX     15
+
+#define MY_DEV_KV_F_DELETE      0x01    // MY_DEV_KV_SET: remove name instead
+#define MY_DEV_KV_F_FORMAT      0x02    // MY_DEV_KV_SET: write an empty directory; name is ignored
+
+typedef struct mydev_kv
+{
+    char     name[MY_DEV_KV_NAME_MAX + 1];    // NUL terminated
+    uint8_t  value[MY_DEV_KV_VALUE_MAX + 1];
+    uint8_t  len;                             // bytes of value used
+    uint8_t  flags;                           // MY_DEV_KV_F_*
+    uint8_t  reserved[2];
+} mydev_kv_t;
+
+// Whole NVRAM image in one call. MY_DEV_SNAPSHOT fills data (as read() would, or from the ports
+// with MY_DEV_IMAGE_F_HW) and sets the mask bits of every offset from MY_DEV_RTC_REGS on, so
+// its result can be handed to MY_DEV_RESTORE unchanged. MY_DEV_RESTORE writes the offsets set in
+// mask, skipping those that already hold the value, and reports how many it wrote; the live RTC
+// registers (below MY_DEV_RTC_REGS) can't be restored and make it fail with -EINVAL.
+#define MY_DEV_IMAGE_F_HW       0x01    // MY_DEV_SNAPSHOT: re-read every cached byte from the port first
+
+typedef struct mydev_image
+{
+    uint64_t mask[MY_DEV_NVRAM_SIZE / 64];    // bit (n % 64) of mask[n / 64] is offset n
+    uint8_t  data[MY_DEV_NVRAM_SIZE];
+    uint32_t flags;                           // MY_DEV_IMAGE_F_*
+    uint32_t written;                         // out, MY_DEV_RESTORE: bytes that differed
+} mydev_image_t;
+
+// io_uring: an IORING_OP_URING_CMD SQE on DEV_NAME takes cmd_op = MY_DEV_READ, MY_DEV_READ_HW,
+// MY_DEV_WRITE, MY_DEV_READV, MY_DEV_WRITEV, MY_DEV_SET_BITS, MY_DEV_CLEAR_BITS,
+// MY_DEV_TOGGLE_BITS or MY_DEV_CMPXCHG, with the argument struct of that ioctl copied into the
+// SQE's cmd area. The CQE's res carries the result instead of the struct: the byte read for
+// the reads, the prior value for the bit ops and CMPXCHG, 0 otherwise, or -errno.
+#define MY_DEV_URING_CMD_BYTES 16    // cmd area of a plain 64-byte SQE
+
 #define DEV_NAME      "my-dev"
+#define NMI_DEV_NAME  "my-dev-nmi"
 #define MY_DEV_READ   _IOR('F', 0, mydev_data_t)
 #define MY_DEV_WRITE  _IOW('F', 1, mydev_data_t)
+// Run all entries under one lock hold; READV copies the entries back, WRITEV does not
+#define MY_DEV_READV  _IOWR('F', 2, mydev_vec_t)
+#define MY_DEV_WRITEV _IOW('F', 3, mydev_vec_t)
+// Same as MY_DEV_READ, but always goes to the port and refreshes the shadow byte
+#define MY_DEV_READ_HW _IOWR('F', 4, mydev_data_t)
+// Push writes queued by the driver's write-back mode to the ports now; fsync() does the same
+#define MY_DEV_FLUSH   _IO('F', 5)
+#define MY_DEV_SET_BITS    _IOWR('F', 6, mydev_rmw_t)
+#define MY_DEV_CLEAR_BITS  _IOWR('F', 7, mydev_rmw_t)
+#define MY_DEV_TOGGLE_BITS _IOWR('F', 8, mydev_rmw_t)
+#define MY_DEV_CMPXCHG     _IOWR('F', 9, mydev_rmw_t)
+// -EAGAIN until the first snapshot is in, shortly after the driver loads; -EOPNOTSUPP on
+// instances that don't follow the RTC (sim backends, port instances after the first)
+#define MY_DEV_RTC_TIME    _IOR('F', 10, mydev_rtc_time_t)
+// Each open file of DEV_NAME subscribes to the offsets in a bitmap. poll() reports EPOLLPRI
+// once a subscribed byte has changed; MY_DEV_CHANGES returns which ones and clears them.
+#define MY_DEV_WATCH       _IOW('F', 11, mydev_watch_t)
+#define MY_DEV_CHANGES     _IOR('F', 12, mydev_watch_t)
+// Configure the checksum region, or read it back with the checksum recomputed from the shadow;
+// VERIFY fails with -ENODATA while no region is configured
+#define MY_DEV_CSUM_SET    _IOW('F', 13, mydev_csum_t)
+#define MY_DEV_CSUM_VERIFY _IOR('F', 14, mydev_csum_t)
+// Named variables: -ENODATA until the directory is formatted, -ENOENT for an unknown name,
+// -ENOSPC when the area is full
+#define MY_DEV_KV_GET      _IOWR('F', 15, mydev_kv_t)
+#define MY_DEV_KV_SET      _IOW('F', 16, mydev_kv_t)
+#define MY_DEV_SNAPSHOT    _IOWR('F', 17, mydev_image_t)
+#define MY_DEV_RESTORE     _IOWR('F', 18, mydev_image_t)
+
+#ifdef __KERNEL__
+// Exported by cmos_dev for other kernel modules; offsets are in the unified space above.
+// read0/write0 wrap the offset, the range variants return -EINVAL for a range outside it.
+// The write calls refuse the RTC registers as above; write0 drops such a write.
+uint8_t my_dev_read0(uint16_t offset);
+void    my_dev_write0(uint16_t offset, uint8_t data);
+int     my_dev_read_range0(uint16_t offset, uint8_t *buf, size_t count);
+int     my_dev_write_range0(uint16_t offset, const uint8_t *buf, size_t count);
+int     my_dev_batch0(mydev_vec_entry_t *entries, size_t count);
+int     my_dev_read_cached0(uint16_t offset, uint8_t *buf, size_t count);
+
+// Per-bank lock wait and hold times summed over CPUs since load or the last debugfs reset;
+// bucket b counts times in [2^b, 2^(b+1)) ns, the last one everything slower
+#define MY_DEV_LOCK_HIST_BUCKETS 32
+
+struct my_dev_lock_hist
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t bucket[MY_DEV_LOCK_HIST_BUCKETS];
+};
+
+struct my_dev_lock_stats
+{
+    struct my_dev_lock_hist wait[MY_DEV_NUM_BANKS];
+    struct my_dev_lock_hist hold[MY_DEV_NUM_BANKS];
+};
 
+int     my_dev_lock_stats0(struct my_dev_lock_stats *stats);
+#endif
@@ -0,0 +1,405 @@
+/****************************************************************************************
+ * Companion test module for cmos_dev: measures the driver's locking from inside the kernel,
+ * with no syscall cost on top.
+ *
+ * One kthread per CPU, bound to it, calls the exported my_dev_read0/my_dev_write0 of instance
+ * 0 in a loop over the offsets base .. base + span - 1, write_pct percent of the calls being
+ * writes. A write stores the value the byte held when the run started, so NVRAM is left as
+ * it was found. Reads served from the driver's shadow take no lock, so the mix sets how
+ * contended the bank locks get.
+ *
+ *     modprobe cmos_dev backend=sim sim_latency_ns=1000
+ *     insmod cmos_dev_kbench.ko write_pct=20 run_ms=2000
+ *     echo 1 > /sys/kernel/debug/cmos_dev_kbench/run          # returns when the run is over
+ *     cat /sys/kernel/debug/cmos_dev_kbench/results
+ * Parameters can be changed between runs under /sys/module/cmos_dev_kbench/parameters; a run
+ * takes its own copy when it starts, so a change in the middle of one waits for the next.
+ *
+ * results has the ops/s in total and per CPU, the latency of the read and write calls, and
+ * the driver's lock wait and hold times per bank over the run (my_dev_lock_stats0). Latency
+ * percentiles come from log2 buckets and are upper bounds. The lock times count every user
+ * of the driver during the run, not just the kthreads.
+ *
+ * Built next to cmos_dev, which must be loaded first for the symbols:
+ *     obj-m += cmos_dev.o cmos_dev_kbench.o
+ ****************************************************************************************/
+
+#include <linux/init.h>
+#include <linux/module.h>
+#include <linux/types.h>
+#include <linux/moduleparam.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/cpu.h>
+#include <linux/cpumask.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/delay.h>
+#include <linux/random.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>    // local_clock
+#include <linux/timekeeping.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+
+#include "cmos_dev.h"
+
+#define KB_NAME     "cmos_dev_kbench"
+#define KB_BATCH    64      // calls between cond_resched()
+
+static unsigned int nr_threads;
+module_param(nr_threads, uint, 0644);
+MODULE_PARM_DESC(nr_threads, "kthreads, on the first online CPUs; 0 for one on every online CPU (default: 0)");
+
+static unsigned int write_pct = 10;
+module_param(write_pct, uint, 0644);
+MODULE_PARM_DESC(write_pct, "Percent of calls that are my_dev_write0, 0-100 (default: 10)");
+
+static unsigned int run_ms = 2000;
+module_param(run_ms, uint, 0644);
+MODULE_PARM_DESC(run_ms, "Length of a run, in ms (default: 2000)");
+
+static unsigned int base = MY_DEV_BANK1_BASE;
+module_param(base, uint, 0644);
+MODULE_PARM_DESC(base, "First offset used, in the unified space, not below the RTC registers (default: 0x80)");
+
+static unsigned int span = MY_DEV_BANK_SIZE;
+module_param(span, uint, 0644);
+MODULE_PARM_DESC(span, "Number of offsets used from base on (default: 128)");
+
+// Bucket b counts calls that took [2^b, 2^(b+1)) ns, like the driver's own histograms
+struct kb_hist {
+    u64 count;
+    u64 total_ns;
+    u64 max_ns;
+    u64 bucket[MY_DEV_LOCK_HIST_BUCKETS];
+};
+
+// Parameters of one run, copied and checked once under kb_lock; the kthreads only see these
+struct kb_cfg {
+    unsigned int nr, write_pct, run_ms, base, span;
+};
+
+struct kb_thread {
+    struct task_struct  *task;
+    const struct kb_cfg *cfg;
+    int                  cpu;
+    u32                  rnd;        // xorshift32 state, never 0
+    u64                  start_ns;   // ktime_get_ns(), comparable across CPUs
+    u64                  end_ns;
+    u64                  ops;
+    struct kb_hist       read;
+    struct kb_hist       write;
+};
+
+// Last completed run, under kb_lock
+static struct {
+    struct kb_cfg            cfg;
+    struct kb_thread        *thr;
+    struct my_dev_lock_stats lock;      // difference over the run
+} kb_res;
+
+static DEFINE_MUTEX(kb_lock);               // one run at a time, and kb_res
+static uint8_t        kb_orig[MY_DEV_NVRAM_SIZE];
+static bool           kb_stop;
+static struct dentry *kb_debugfs;
+
+static inline u32 kb_rand(struct kb_thread *t)
+{
+    t->rnd ^= t->rnd << 13;
+    t->rnd ^= t->rnd >> 17;
+    t->rnd ^= t->rnd << 5;
+    return t->rnd;
+}
+
+static void kb_hist_add(struct kb_hist *h, u64 ns)
+{
+    h->count++;
+    h->total_ns += ns;
+    h->max_ns    = max(h->max_ns, ns);
+    h->bucket[ns ? min_t(unsigned int, ilog2(ns), MY_DEV_LOCK_HIST_BUCKETS - 1) : 0]++;
+}
+
+static int kb_thread_fn(void *arg)
+{
+    struct kb_thread    *t   = arg;
+    const struct kb_cfg *cfg = t->cfg;
+    unsigned int         i;
+
+    t->start_ns = ktime_get_ns();
+    while (!READ_ONCE(kb_stop) && !kthread_should_stop())
+    {
+        for (i = 0; i < KB_BATCH; i++)
+        {
+            u32      r     = kb_rand(t);
+            uint16_t off   = cfg->base + r % cfg->span;
+            bool     write = (r >> 16) % 100 < cfg->write_pct;
+            u64      start = local_clock();     // same CPU at both ends, bound
+
+            if (write)
+            {
+                my_dev_write0(off, kb_orig[off]);
+                kb_hist_add(&t->write, local_clock() - start);
+            }
+            else
+            {
+                (void)my_dev_read0(off);
+                kb_hist_add(&t->read, local_clock() - start);
+            }
+        }
+        t->ops += KB_BATCH;
+        cond_resched();
+    }
+    t->end_ns = ktime_get_ns();
+
+    // Stay around for kthread_stop(), which owns the task
+    set_current_state(TASK_INTERRUPTIBLE);
+    while (!kthread_should_stop())
+    {
+        schedule();
+        set_current_state(TASK_INTERRUPTIBLE);
+    }
+    __set_current_state(TASK_RUNNING);
+    return 0;
+}
+
+static void kb_lock_hist_sub(struct my_dev_lock_hist *a, const struct my_dev_lock_hist *b)
+{
+    int i;
+
+    a->count    -= b->count;
+    a->total_ns -= b->total_ns;
+    for (i = 0; i < MY_DEV_LOCK_HIST_BUCKETS; i++)
+        a->bucket[i] -= b->bucket[i];
+}
+
+static int kb_run(void)
+{
+    struct my_dev_lock_stats *before = NULL;
+    struct kb_thread         *thr = NULL;
+    struct kb_cfg             cfg;
+    unsigned int              started = 0, i;
+    int                       cpu, ret;
+
+    mutex_lock(&kb_lock);
+    cfg.nr        = READ_ONCE(nr_threads);
+    cfg.write_pct = READ_ONCE(write_pct);
+    cfg.run_ms    = READ_ONCE(run_ms);
+    cfg.base      = READ_ONCE(base);
+    cfg.span      = READ_ONCE(span);
+    cfg.nr        = cfg.nr ? min(cfg.nr, num_online_cpus()) : num_online_cpus();
+    if (cfg.span == 0 || cfg.base < MY_DEV_RTC_REGS || cfg.base >= MY_DEV_NVRAM_SIZE ||
+        cfg.span > MY_DEV_NVRAM_SIZE - cfg.base || cfg.write_pct > 100)
+    {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    thr    = kcalloc(cfg.nr, sizeof(*thr), GFP_KERNEL);
+    before = kmalloc(sizeof(*before), GFP_KERNEL);
+    ret    = (thr && before) ? 0 : -ENOMEM;
+
+    // -ENODEV until cmos_dev has probed instance 0
+    if (!ret)
+        ret = my_dev_read_range0(cfg.base, &kb_orig[cfg.base], cfg.span);
+    if (!ret)
+        ret = my_dev_lock_stats0(before);
+    if (ret)
+        goto out;
+
+    WRITE_ONCE(kb_stop, false);
+    cpus_read_lock();
+    for_each_online_cpu(cpu)
+    {
+        struct task_struct *task;
+
+        if (started == cfg.nr)
+            break;
+        task = kthread_create(kb_thread_fn, &thr[started], KB_NAME "/%d", cpu);
+        if (IS_ERR(task))
+        {
+            ret = PTR_ERR(task);
+            break;
+        }
+        kthread_bind(task, cpu);
+        thr[started].task = task;
+        thr[started].cfg  = &cfg;
+        thr[started].cpu  = cpu;
+        thr[started].rnd  = get_random_u32() | 1;
+        started++;
+    }
+    if (!ret)
+        for (i = 0; i < started; i++)
+            wake_up_process(thr[i].task);
+    cpus_read_unlock();
+
+    if (!ret)
+        msleep_interruptible(cfg.run_ms);
+    WRITE_ONCE(kb_stop, true);
+    for (i = 0; i < started; i++)
+        kthread_stop(thr[i].task);
+    if (ret)
+        goto out;
+
+    kfree(kb_res.thr);
+    kb_res.thr = thr;
+    kb_res.cfg = cfg;
+    thr        = NULL;
+    my_dev_lock_stats0(&kb_res.lock);
+    for (i = 0; i < MY_DEV_NUM_BANKS; i++)
+    {
+        kb_lock_hist_sub(&kb_res.lock.wait[i], &before->wait[i]);
+        kb_lock_hist_sub(&kb_res.lock.hold[i], &before->hold[i]);
+    }
+    pr_info(KB_NAME ": run done, %u threads\n", cfg.nr);
+
+out:
+    mutex_unlock(&kb_lock);
+    kfree(before);
+    kfree(thr);
+    return ret;
+}
+
+/****************************************************************************************
+ * debugfs: cmos_dev_kbench/run and cmos_dev_kbench/results
+ ****************************************************************************************/
+
+// Upper bound of the bucket holding the permille-th call
+static u64 kb_pct(const u64 *bucket, u64 count, unsigned int permille)
+{
+    u64 rank = div_u64(count * permille, 1000);
+    u64 seen = 0;
+    int b;
+
+    for (b = 0; b < MY_DEV_LOCK_HIST_BUCKETS; b++)
+    {
+        seen += bucket[b];
+        if (seen > rank)
+            break;
+    }
+    return 2ULL << min(b, MY_DEV_LOCK_HIST_BUCKETS - 1);
+}
+
+// max_ns 0 prints as "-": the driver's lock histograms don't keep a maximum
+static void kb_show_row(struct seq_file *m, const char *name, const u64 *bucket, u64 count, u64 total_ns, u64 max_ns)
+{
+    if (!count)
+    {
+        seq_printf(m, "%-16s %10d\n", name, 0);
+        return;
+    }
+    seq_printf(m, "%-16s %10llu %8llu %8llu %8llu %8llu", name, count, div64_u64(total_ns, count),
+               kb_pct(bucket, count, 500), kb_pct(bucket, count, 990), kb_pct(bucket, count, 999));
+    if (max_ns)
+        seq_printf(m, " %8llu\n", max_ns);
+    else
+        seq_printf(m, " %8s\n", "-");
+}
+
+static int kb_results_show(struct seq_file *m, void *v)
+{
+    struct kb_hist read, write;
+    u64            start = U64_MAX, end = 0, ops = 0;
+    unsigned int   i;
+    int            b, ret;
+
+    ret = mutex_lock_interruptible(&kb_lock);
+    if (ret)
+        return ret;
+    if (!kb_res.thr)
+    {
+        seq_puts(m, "no run yet: echo 1 > run\n");
+        mutex_unlock(&kb_lock);
+        return 0;
+    }
+
+    memset(&read, 0, sizeof(read));
+    memset(&write, 0, sizeof(write));
+    for (i = 0; i < kb_res.cfg.nr; i++)
+    {
+        struct kb_thread *t = &kb_res.thr[i];
+
+        start = min(start, t->start_ns);
+        end   = max(end, t->end_ns);
+        ops  += t->ops;
+        read.count     += t->read.count;
+        read.total_ns  += t->read.total_ns;
+        read.max_ns     = max(read.max_ns, t->read.max_ns);
+        write.count    += t->write.count;
+        write.total_ns += t->write.total_ns;
+        write.max_ns    = max(write.max_ns, t->write.max_ns);
+        for (b = 0; b < MY_DEV_LOCK_HIST_BUCKETS; b++)
+        {
+            read.bucket[b]  += t->read.bucket[b];
+            write.bucket[b] += t->write.bucket[b];
+        }
+    }
+
+    seq_printf(m, "threads %u, write_pct %u, offsets 0x%02x-0x%02x, %llu ms\n", kb_res.cfg.nr, kb_res.cfg.write_pct,
+               kb_res.cfg.base, kb_res.cfg.base + kb_res.cfg.span - 1, div_u64(end - start, NSEC_PER_MSEC));
+    seq_printf(m, "total  %12llu ops/s\n", div64_u64(ops * NSEC_PER_SEC, max(end - start, 1ULL)));
+    for (i = 0; i < kb_res.cfg.nr; i++)
+    {
+        struct kb_thread *t = &kb_res.thr[i];
+
+        seq_printf(m, "cpu%-3d %12llu ops/s\n", t->cpu,
+                   div64_u64(t->ops * NSEC_PER_SEC, max(t->end_ns - t->start_ns, 1ULL)));
+    }
+
+    seq_printf(m, "\n%-16s %10s %8s %8s %8s %8s %8s\n", "ns", "count", "avg", "p50<=", "p99<=", "p99.9<=", "max");
+    kb_show_row(m, "read0", read.bucket, read.count, read.total_ns, max(read.max_ns, 1ULL));
+    kb_show_row(m, "write0", write.bucket, write.count, write.total_ns, max(write.max_ns, 1ULL));
+    for (b = 0; b < MY_DEV_NUM_BANKS; b++)
+    {
+        const struct my_dev_lock_hist *w = &kb_res.lock.wait[b];
+        const struct my_dev_lock_hist *h = &kb_res.lock.hold[b];
+        char                           name[24];
+
+        snprintf(name, sizeof(name), "lock_wait_bank%d", b);
+        kb_show_row(m, name, w->bucket, w->count, w->total_ns, 0);
+        snprintf(name, sizeof(name), "lock_hold_bank%d", b);
+        kb_show_row(m, name, h->bucket, h->count, h->total_ns, 0);
+    }
+
+    mutex_unlock(&kb_lock);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(kb_results);
+
+static ssize_t kb_run_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos)
+{
+    int ret = kb_run();
+
+    return ret ? ret : count;
+}
+
+static const struct file_operations kb_run_fops = {
+    .owner          = THIS_MODULE,
+    .open           = simple_open,
+    .write          = kb_run_write,
+    .llseek         = noop_llseek,
+};
+
+static int __init kb_init(void)
+{
+    kb_debugfs = debugfs_create_dir(KB_NAME, NULL);
+    debugfs_create_file("run",     0200, kb_debugfs, NULL, &kb_run_fops);
+    debugfs_create_file("results", 0444, kb_debugfs, NULL, &kb_results_fops);
+    pr_info(KB_NAME ": echo 1 > /sys/kernel/debug/" KB_NAME "/run to start a run\n");
+    return 0;
+}
+
+static void __exit kb_exit(void)
+{
+    debugfs_remove_recursive(kb_debugfs);
+    kfree(kb_res.thr);
+}
+
+module_init(kb_init);
+module_exit(kb_exit);
+
+MODULE_LICENSE("GPL");      // my_dev_read0 and friends are EXPORT_SYMBOL_GPL
+MODULE_VERSION("0.1");
+MODULE_DESCRIPTION("Lock contention benchmark for the CMOS DEV driver");
+MODULE_AUTHOR("dyulu <dyulu@example.com>");
@@ -0,0 +1,260 @@
+/******************************************************************************************
+ * Multi-threaded stress benchmark for the cmos_dev driver locking.
+ *
+ * Runs the same access pattern from 1, 2, 4, ... N threads, each pinned to its own CPU,
+ * and prints aggregate and per-thread throughput so scaling is visible at a glance.
+ * Cached reads should scale with the thread count since they never take a lock; port
+ * reads and writes serialize on the bank 1 lock and should stay flat. All offsets are in
+ * bank 1 (0x80-0xFF) so the RTC's rtc_lock stays out of the picture.
+ *
+ * gcc -O2 -Wall -pthread -o cmos_dev_stress cmos_dev_stress.c
+ *
+ * Without the extended bank, load the driver on its simulated backend first:
+ *     modprobe cmos_dev backend=sim sim_latency_ns=1000
+ *
+ * Another instance, e.g. a sim one next to the hardware, through the environment:
+ *     MY_DEV=/dev/my-dev1 ./cmos_dev_stress -m readhw
+ *
+ * ./cmos_dev_stress [-m read|readhw|write|mix|readv|pread] [-t MAX_THREADS] [-d SECONDS]
+ *     read    MY_DEV_READ ioctl, served from the driver's shadow
+ *     readhw  MY_DEV_READ_HW ioctl, always a port access under the lock
+ *     write   MY_DEV_WRITE ioctl of the value already held (0xFF, harmless)
+ *     mix     9 cached reads to 1 write
+ *     readv   MY_DEV_READV of the whole bank per call (throughput in bytes)
+ *     pread   pread() of the whole bank per call (throughput in bytes)
+ *****************************************************************************************/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>       // strtol
+#include <fcntl.h>        // open
+#include <unistd.h>       // close, getopt
+#include <sys/ioctl.h>    // ioctl
+#include <string.h>       // strcmp
+#include <stdint.h>       // uint32_t, etc
+#include <pthread.h>
+#include <sched.h>        // CPU_SET
+#include <time.h>         // clock_gettime
+
+#include "cmos_dev.h"
+
+// Instance 0 unless the MY_DEV environment variable names another, e.g. MY_DEV=/dev/my-dev1
+static const char *my_dev_path(void)
+{
+    const char *path = getenv("MY_DEV");
+    return path ? path : "/dev/"DEV_NAME;
+}
+#define MY_DEV my_dev_path()
+
+enum { MODE_READ, MODE_READHW, MODE_WRITE, MODE_MIX, MODE_READV, MODE_PREAD };
+
+static const char *mode_names[] = { "read", "readhw", "write", "mix", "readv", "pread" };
+
+typedef struct thread_arg
+{
+    pthread_t     tid;
+    int           cpu;
+    int           mode;
+    uint8_t       value;      // current content of offset 0xFF, rewritten by write/mix
+    volatile int *stop;
+    uint64_t      ops;        // operations (bytes for readv/pread) completed
+    int           err;
+} thread_arg_t;
+
+static void *worker(void *p)
+{
+    thread_arg_t     *arg = p;
+    mydev_vec_entry_t entries[MY_DEV_BANK_SIZE];
+    mydev_vec_t       vec;
+    uint8_t           bank[MY_DEV_BANK_SIZE];
+    mydev_data_t      dev_data;
+    cpu_set_t         set;
+    uint32_t          n = 0;
+
+    CPU_ZERO(&set);
+    CPU_SET(arg->cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    // One fd per thread, as independent agents would have
+    int fd = open(MY_DEV, O_RDWR);
+    if( fd < 0 )
+    {
+        arg->err = 1;
+        return NULL;
+    }
+
+    for( int i = 0; i < MY_DEV_BANK_SIZE; i++ )
+    {
+        entries[i].offset   = MY_DEV_BANK1_BASE + i;
+        entries[i].op       = MY_DEV_OP_READ;
+        entries[i].data     = 0;
+        entries[i].reserved = 0;
+    }
+    vec.entries  = (uint64_t)(uintptr_t)entries;
+    vec.count    = MY_DEV_BANK_SIZE;
+    vec.reserved = 0;
+
+    while( !*arg->stop )
+    {
+        int ret = 0;
+
+        dev_data.offset = MY_DEV_BANK1_BASE + (n++ & (MY_DEV_BANK_SIZE - 1));
+        switch( arg->mode )
+        {
+            case MODE_READ:
+                ret = ioctl(fd, MY_DEV_READ, &dev_data);
+                arg->ops++;
+                break;
+            case MODE_READHW:
+                ret = ioctl(fd, MY_DEV_READ_HW, &dev_data);
+                arg->ops++;
+                break;
+            case MODE_MIX:
+                if( n % 10 )
+                {
+                    ret = ioctl(fd, MY_DEV_READ, &dev_data);
+                    arg->ops++;
+                    break;
+                }
+                // fall through
+            case MODE_WRITE:
+                dev_data.offset = 0xFF;
+                dev_data.data   = arg->value;
+                ret = ioctl(fd, MY_DEV_WRITE, &dev_data);
+                arg->ops++;
+                break;
+            case MODE_READV:
+                ret = ioctl(fd, MY_DEV_READV, &vec);
+                arg->ops += MY_DEV_BANK_SIZE;
+                break;
+            case MODE_PREAD:
+                ret = (pread(fd, bank, sizeof(bank), MY_DEV_BANK1_BASE) == sizeof(bank)) ? 0 : -1;
+                arg->ops += MY_DEV_BANK_SIZE;
+                break;
+        }
+
+        if( ret != 0 )
+        {
+            arg->err = 1;
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+    int mode        = MODE_READ;
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int seconds     = 2;
+    int opt;
+
+    while( (opt = getopt(argc, argv, "m:t:d:")) != -1 )
+    {
+        switch( opt )
+        {
+            case 'm':
+                mode = -1;
+                for( int i = 0; i < (int)(sizeof(mode_names) / sizeof(mode_names[0])); i++ )
+                    if( strcmp(optarg, mode_names[i]) == 0 )
+                        mode = i;
+                if( mode < 0 )
+                {
+                    printf("Unknown mode: %s\n", optarg);
+                    return -1;
+                }
+                break;
+            case 't':
+                max_threads = (int)strtol(optarg, NULL, 0);
+                break;
+            case 'd':
+                seconds = (int)strtol(optarg, NULL, 0);
+                break;
+            default:
+                printf("Usage: %s [-m read|readhw|write|mix|readv|pread] [-t MAX_THREADS] [-d SECONDS]\n", argv[0]);
+                return -1;
+        }
+    }
+
+    if( max_threads < 1 || seconds < 1 )
+    {
+        printf("Bad thread count or duration\n");
+        return -1;
+    }
+
+    // Learn the current value of 0xFF so write/mix modes leave NVRAM as they found it
+    mydev_data_t dev_data = { .data = 0, .offset = 0xFF };
+    int fd = open(MY_DEV, O_RDWR);
+    if( fd < 0 || ioctl(fd, MY_DEV_READ, &dev_data) != 0 )
+    {
+        printf("Failed to open/read MY_DEV\n");
+        return -1;
+    }
+    close(fd);
+
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    thread_arg_t *args = calloc(max_threads, sizeof(*args));
+    if( !args )
+        return -1;
+
+    printf("mode %s, %d s per step, %s/s\n", mode_names[mode], seconds,
+           (mode == MODE_READV || mode == MODE_PREAD) ? "bytes" : "ops");
+    printf("%8s %16s %16s %8s\n", "threads", "total/s", "per-thread/s", "scaling");
+
+    double base = 0;
+    // 1, 2, 4, ... and always finish on max_threads
+    for( int nthreads = 1; nthreads <= max_threads; nthreads = (nthreads < max_threads && nthreads * 2 > max_threads) ? max_threads : nthreads * 2 )
+    {
+        volatile int stop = 0;
+
+        for( int i = 0; i < nthreads; i++ )
+        {
+            memset(&args[i], 0, sizeof(args[i]));
+            args[i].cpu   = i % cpus;
+            args[i].mode  = mode;
+            args[i].value = dev_data.data;
+            args[i].stop  = &stop;
+        }
+
+        double start = now_sec();
+        for( int i = 0; i < nthreads; i++ )
+            pthread_create(&args[i].tid, NULL, worker, &args[i]);
+
+        sleep(seconds);
+        stop = 1;
+
+        uint64_t total = 0;
+        int      err   = 0;
+        for( int i = 0; i < nthreads; i++ )
+        {
+            pthread_join(args[i].tid, NULL);
+            total += args[i].ops;
+            err   |= args[i].err;
+        }
+        double elapsed = now_sec() - start;
+
+        if( err )
+        {
+            printf("I/O on MY_DEV failed with %d threads\n", nthreads);
+            free(args);
+            return -1;
+        }
+
+        double rate = total / elapsed;
+        if( nthreads == 1 )
+            base = rate;
+        printf("%8d %16.0f %16.0f %7.2fx\n", nthreads, rate, rate / nthreads, base ? rate / base : 0);
+    }
+
+    free(args);
+    return 0;
+}
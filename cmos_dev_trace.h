@@ -0,0 +1,66 @@
+/******************************************************************************************
+ * Tracepoints of the cmos_dev driver; they cost a patched-out branch until enabled:
+ *     echo 1 > /sys/kernel/tracing/events/cmos_dev/enable
+ *     cat /sys/kernel/tracing/trace_pipe
+ *
+ * Built together with cmos_dev.c, which needs its own directory on the include path for
+ * define_trace.h to find this file again:
+ *     CFLAGS_cmos_dev.o := -I$(src)
+ *****************************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM cmos_dev
+
+#if !defined(_CMOS_DEV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _CMOS_DEV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(my_dev_file,
+    TP_PROTO(struct inode *inode, struct file *file),
+    TP_ARGS(inode, file),
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(const void *, file)
+    ),
+    TP_fast_assign(
+        __entry->minor = iminor(inode);
+        __entry->file  = file;
+    ),
+    TP_printk("minor:%u file:%p", __entry->minor, __entry->file)
+);
+
+DEFINE_EVENT(my_dev_file, my_dev_open,
+    TP_PROTO(struct inode *inode, struct file *file),
+    TP_ARGS(inode, file)
+);
+
+DEFINE_EVENT(my_dev_file, my_dev_release,
+    TP_PROTO(struct inode *inode, struct file *file),
+    TP_ARGS(inode, file)
+);
+
+// Single byte ioctls, after the argument was copied in
+TRACE_EVENT(my_dev_ioctl,
+    TP_PROTO(unsigned int cmd, uint32_t offset, uint8_t data),
+    TP_ARGS(cmd, offset, data),
+    TP_STRUCT__entry(
+        __field(unsigned int, cmd)
+        __field(uint32_t,     offset)
+        __field(uint8_t,      data)
+    ),
+    TP_fast_assign(
+        __entry->cmd    = cmd;
+        __entry->offset = offset;
+        __entry->data   = data;
+    ),
+    TP_printk("ioctl:%x offset:%x data:%x", __entry->cmd, __entry->offset, __entry->data)
+);
+
+#endif /* _CMOS_DEV_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE cmos_dev_trace
+#include <trace/define_trace.h>
@@ -1,6 +1,8 @@
 /******************************************************************************************
  * Kernel driver implements access to device register space.
  * sysfs entry: /dev/DEV_NAME
+ *
+ * gcc -O2 -Wall -o cmos_dev_user cmos_dev_user.c libcmos.c
  *****************************************************************************************/
 
 #include <stdio.h>
@@ -10,56 +12,916 @@
 #include <sys/ioctl.h>    // ioctl
 #include <string.h>       // strcmp
 #include <stdint.h>       // uint32_t, etc
+#include <sys/mman.h>     // mmap
+#include <poll.h>         // poll
+#include <sys/syscall.h>  // io_uring_setup, io_uring_enter
+#include <linux/io_uring.h>
+#include <time.h>         // clock_gettime
+#include <sys/socket.h>   // socket, setsockopt
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
 
-#include "cmos_dev.h"
+#include "libcmos.h"
 
-#define MY_DEV "/dev/"DEV_NAME
+// Instance 0 unless the MY_DEV environment variable names another, e.g. MY_DEV=/dev/my-dev1.
+// One libcmos handle serves every mode; the byte and range modes take its fastest path, the
+// others issue their ioctl on cmos_fd() and need the driver.
+#define MY_NMI "/dev/"NMI_DEV_NAME
 
-int main(int argc, char *argv[])
+// readv OFFSET...            -- read all offsets as one batch
+// writev OFFSET VALUE ...    -- write all pairs as one batch
+static int do_vec(cmos_t *h, char* action, int argc, char *argv[])
 {
-    if( argc > 4 )
+    mydev_vec_entry_t entries[MY_DEV_VEC_MAX];
+    int               is_read = (strcmp(action, "readv") == 0);
+    int               step    = is_read ? 1 : 2;
+    uint32_t          count   = 0;
+
+    if( argc < 3 || (!is_read && (argc - 2) % 2) || (argc - 2) / step > MY_DEV_VEC_MAX )
     {
-        printf("Too many arguments supplied: %d\n", argc);
+        printf("Bad argument list for %s\n", action);
+        return -1;
+    }
+
+    memset(entries, 0, sizeof(entries));
+    for( int i = 2; i < argc; i += step, count++ )
+    {
+        entries[count].offset = (uint32_t)strtol(argv[i], NULL, 0);
+        entries[count].op     = is_read ? MY_DEV_OP_READ : MY_DEV_OP_WRITE;
+        if( !is_read )
+            entries[count].data = (uint8_t)strtol(argv[i + 1], NULL, 0);
+    }
+
+    if( cmos_batch(h, entries, count) != 0 )
+    {
+        printf("Failed to %s MY_DEV\n", action);
         return -1;
     }
 
-    char* action    = argv[1];
-    mydev_data_t dev_data;
-    dev_data.offset = (uint32_t)strtol(argv[2], NULL, 0);   // argv[2] = 0x????
-    dev_data.data   = 0;
+    for( uint32_t i = 0; i < count; i++ )
+        printf("%s: Offset %04x: %02x\n", cmos_path_name(cmos_last_path(h)), entries[i].offset, entries[i].data);
+
+    return 0;
+}
+
+// snapshot [COUNT] -- dump COUNT consistent copies of the driver's shadow page, one second apart.
+//     The RTC registers 0x00-0x0D are never cached and read as stale here.
+static int do_snapshot(cmos_t *h, int count)
+{
+    uint8_t  nvram[MY_DEV_NVRAM_SIZE];
+    uint32_t seq[MY_DEV_NUM_BANKS];
+
+    for( int n = 0; n < count; n++ )
+    {
+        if( n )
+            sleep(1);
+
+        if( cmos_shadow_snapshot(h, nvram, seq) != 0 )
+        {
+            printf("Failed to mmap MY_DEV\n");
+            return -1;
+        }
+        printf("Snapshot seq %u/%u:\n", seq[0], seq[1]);
+        for( int i = 0; i < MY_DEV_NVRAM_SIZE; i++ )
+            printf("%s%02x", (i % 16) ? " " : (i ? "\n" : ""), nvram[i]);
+        printf("\n");
+    }
 
-    int fd = open(MY_DEV, O_RDWR);
+    return 0;
+}
+
+static void print_nmi(const mydev_nmi_event_t *ev)
+{
+    printf("NMI cpu %u at %llu ns:", ev->cpu, (unsigned long long)ev->timestamp_ns);
+    for( int j = 0; j < MY_DEV_NMI_BYTES; j++ )
+        printf(" addr 0x%02X:x%02x", MY_DEV_NMI_OFFSET + j, ev->data[j]);
+    printf("\n");
+}
+
+// nmi [COUNT] -- wait for and print COUNT events recorded by the driver's NMI handler
+static int do_nmi(int count)
+{
+    mydev_nmi_event_t events[64];
+
+    int fd = open(MY_NMI, O_RDONLY | O_NONBLOCK);
     if( fd < 0 )
     {
-        printf("Failed to open MY_DEV\n");
+        printf("Failed to open MY_NMI\n");
+        return -1;
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    while( count > 0 )
+    {
+        if( poll(&pfd, 1, -1) < 0 )
+            break;
+
+        ssize_t len = read(fd, events, sizeof(events));
+        if( len < 0 )
+            continue;       // EAGAIN: another reader got there first
+
+        for( size_t i = 0; i < len / sizeof(events[0]) && count > 0; i++, count-- )
+            print_nmi(&events[i]);
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Index the attributes in data by type; tb has max + 1 entries
+static void nl_parse(struct nlattr *tb[], int max, void *data, int len)
+{
+    struct nlattr *a = data;
+
+    memset(tb, 0, (max + 1) * sizeof(tb[0]));
+    while( len >= (int)sizeof(*a) && a->nla_len >= sizeof(*a) && a->nla_len <= len )
+    {
+        if( (a->nla_type & NLA_TYPE_MASK) <= max )
+            tb[a->nla_type & NLA_TYPE_MASK] = a;
+        len -= NLA_ALIGN(a->nla_len);
+        a    = (struct nlattr *)((char *)a + NLA_ALIGN(a->nla_len));
+    }
+}
+
+// Ask nlctrl for the driver's family, join both of its groups and return the family id
+static int genl_join(int fd)
+{
+    struct
+    {
+        struct nlmsghdr   n;
+        struct genlmsghdr g;
+        struct nlattr     a;
+        char              name[NLA_ALIGN(sizeof(MY_DEV_GENL_NAME))];
+    } req;
+    char           buf[8192];
+    struct nlattr *tb[CTRL_ATTR_MAX + 1];
+    struct nlattr *grp[CTRL_ATTR_MCAST_GRP_MAX + 1];
+
+    memset(&req, 0, sizeof(req));
+    req.n.nlmsg_len   = sizeof(req);
+    req.n.nlmsg_type  = GENL_ID_CTRL;
+    req.n.nlmsg_flags = NLM_F_REQUEST;
+    req.g.cmd         = CTRL_CMD_GETFAMILY;
+    req.g.version     = 1;
+    req.a.nla_len     = NLA_HDRLEN + sizeof(MY_DEV_GENL_NAME);
+    req.a.nla_type    = CTRL_ATTR_FAMILY_NAME;
+    strcpy(req.name, MY_DEV_GENL_NAME);
+
+    if( send(fd, &req, sizeof(req), 0) < 0 )
+        return -1;
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    struct nlmsghdr *n = (struct nlmsghdr *)buf;
+    if( len < 0 || !NLMSG_OK(n, len) || n->nlmsg_type != GENL_ID_CTRL )
+        return -1;      // NLMSG_ERROR: the driver isn't loaded
+
+    nl_parse(tb, CTRL_ATTR_MAX, (char *)NLMSG_DATA(n) + GENL_HDRLEN, n->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+    if( !tb[CTRL_ATTR_FAMILY_ID] || !tb[CTRL_ATTR_MCAST_GROUPS] )
+        return -1;
+
+    // Nested: one nested entry per group, each with a name and an id
+    struct nlattr *g   = (struct nlattr *)((char *)tb[CTRL_ATTR_MCAST_GROUPS] + NLA_HDRLEN);
+    int            rem = tb[CTRL_ATTR_MCAST_GROUPS]->nla_len - NLA_HDRLEN;
+    for( ; rem >= NLA_HDRLEN && g->nla_len >= NLA_HDRLEN && g->nla_len <= rem;
+         rem -= NLA_ALIGN(g->nla_len), g = (struct nlattr *)((char *)g + NLA_ALIGN(g->nla_len)) )
+    {
+        nl_parse(grp, CTRL_ATTR_MCAST_GRP_MAX, (char *)g + NLA_HDRLEN, g->nla_len - NLA_HDRLEN);
+        if( !grp[CTRL_ATTR_MCAST_GRP_ID] )
+            continue;
+        uint32_t id = *(uint32_t *)((char *)grp[CTRL_ATTR_MCAST_GRP_ID] + NLA_HDRLEN);
+        if( setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP, &id, sizeof(id)) != 0 )
+            return -1;
+    }
+
+    return *(uint16_t *)((char *)tb[CTRL_ATTR_FAMILY_ID] + NLA_HDRLEN);
+}
+
+// listen [COUNT] -- print COUNT changes and NMI events multicast by the driver over generic
+//     netlink, or until interrupted; needs no device node, and any number can listen at once
+static int do_listen(int count)
+{
+    static const char *sources[] = { "write", "hw" };
+    char               buf[16384];
+    struct nlattr     *tb[MY_DEV_GENL_A_MAX + 1];
+
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_GENERIC);
+    int family = (fd < 0) ? -1 : genl_join(fd);
+    if( family < 0 )
+    {
+        printf("Failed to join netlink family %s\n", MY_DEV_GENL_NAME);
+        if( fd >= 0 )
+            close(fd);
+        return -1;
+    }
+
+    for( int seen = 0; count <= 0 || seen < count; )
+    {
+        ssize_t len = recv(fd, buf, sizeof(buf), 0);
+        if( len < 0 )
+            break;
+
+        for( struct nlmsghdr *n = (struct nlmsghdr *)buf; NLMSG_OK(n, len); n = NLMSG_NEXT(n, len) )
+        {
+            if( n->nlmsg_type != family )
+                continue;
+
+            struct genlmsghdr *g = NLMSG_DATA(n);
+            nl_parse(tb, MY_DEV_GENL_A_MAX, (char *)g + GENL_HDRLEN, n->nlmsg_len - NLMSG_HDRLEN - GENL_HDRLEN);
+
+            if( tb[MY_DEV_GENL_A_DROPPED] )
+                printf("%u NMI events dropped\n", *(uint32_t *)((char *)tb[MY_DEV_GENL_A_DROPPED] + NLA_HDRLEN));
+
+            if( g->cmd == MY_DEV_GENL_CMD_CHANGE && tb[MY_DEV_GENL_A_CHANGES] && tb[MY_DEV_GENL_A_INSTANCE] )
+            {
+                uint32_t        inst = *(uint32_t *)((char *)tb[MY_DEV_GENL_A_INSTANCE] + NLA_HDRLEN);
+                mydev_change_t *c    = (mydev_change_t *)((char *)tb[MY_DEV_GENL_A_CHANGES] + NLA_HDRLEN);
+                size_t          nc   = (tb[MY_DEV_GENL_A_CHANGES]->nla_len - NLA_HDRLEN) / sizeof(*c);
+
+                for( size_t i = 0; i < nc; i++, seen++ )
+                    printf("Instance %u offset %04x: %02x -> %02x (%s)\n", inst, c[i].offset, c[i].old, c[i].val,
+                           (c[i].source < 2) ? sources[c[i].source] : "?");
+            }
+            else if( g->cmd == MY_DEV_GENL_CMD_NMI && tb[MY_DEV_GENL_A_NMI_EVENTS] )
+            {
+                mydev_nmi_event_t *ev = (mydev_nmi_event_t *)((char *)tb[MY_DEV_GENL_A_NMI_EVENTS] + NLA_HDRLEN);
+                size_t             ne = (tb[MY_DEV_GENL_A_NMI_EVENTS]->nla_len - NLA_HDRLEN) / sizeof(*ev);
+
+                for( size_t i = 0; i < ne; i++, seen++ )
+                    print_nmi(&ev[i]);
+            }
+        }
+        fflush(stdout);
+    }
+
+    close(fd);
+    return 0;
+}
+
+// rtc [COUNT] -- print the RTC time COUNT times, 100 ms apart, from the driver's snapshot
+static int do_rtc(int fd, int count)
+{
+    mydev_rtc_time_t rt;
+
+    for( int n = 0; n < count; n++ )
+    {
+        if( n )
+            usleep(100000);
+
+        if( ioctl(fd, MY_DEV_RTC_TIME, &rt) != 0 )
+        {
+            printf("Failed to get RTC time\n");
+            return -1;
+        }
+
+        printf("%04u-%02u-%02u %02u:%02u:%02u.%06u", rt.year, rt.mon, rt.mday, rt.hour, rt.min, rt.sec, rt.usec);
+        if( rt.error_us >= MY_DEV_RTC_UNSYNCED )
+            printf(" (tick not synced)");
+        else
+            printf(" +/- %u us", rt.error_us);
+        printf(", snapshot %llu ms old\n", (unsigned long long)(rt.age_ns / 1000000));
+    }
+
+    return 0;
+}
+
+// watch OFFSET... -- sleep until any of the offsets changes and print the new values, forever
+static int do_watch(int fd, int argc, char *argv[])
+{
+    mydev_watch_t watch;
+    uint8_t       nvram[MY_DEV_NVRAM_SIZE];
+
+    memset(&watch, 0, sizeof(watch));
+    for( int i = 2; i < argc; i++ )
+    {
+        long offset = strtol(argv[i], NULL, 0);
+        if( offset < 0 || offset >= MY_DEV_NVRAM_SIZE )
+        {
+            printf("Bad offset: %s\n", argv[i]);
+            return -1;
+        }
+        watch.bits[offset / 64] |= 1ULL << (offset % 64);
+    }
+
+    if( ioctl(fd, MY_DEV_WATCH, &watch) != 0 )
+    {
+        printf("Failed to watch MY_DEV\n");
+        return -1;
+    }
+
+    struct pollfd pfd = { .fd = fd, .events = POLLPRI };
+    while( poll(&pfd, 1, -1) >= 0 )
+    {
+        if( !(pfd.revents & POLLPRI) || ioctl(fd, MY_DEV_CHANGES, &watch) != 0 )
+            continue;
+        if( pread(fd, nvram, sizeof(nvram), 0) != sizeof(nvram) )
+            break;
+
+        for( int i = 0; i < MY_DEV_NVRAM_SIZE; i++ )
+            if( watch.bits[i / 64] & (1ULL << (i % 64)) )
+                printf("Offset %04x changed: %02x\n", i, nvram[i]);
+    }
+
+    return -1;
+}
+
+// csum verify                            -- recompute the checksum from the driver's shadow
+// csum START END OFFSET [ALG] [fix]      -- have the driver keep a checksum current from now on
+//     ALG: sum16be (default, PC/AT), sum16le, sum8, xor8 or none; fix rewrites it to match now
+static int do_csum(int fd, int argc, char *argv[])
+{
+    static const char *algs[] = { "none", "sum8", "sum16be", "sum16le", "xor8" };
+    mydev_csum_t       cs;
+
+    memset(&cs, 0, sizeof(cs));
+    int verify = (argc == 3 && strcmp(argv[2], "verify") == 0);
+    if( !verify )
+    {
+        if( argc < 5 || argc > 7 )
+        {
+            printf("Bad argument list for csum\n");
+            return -1;
+        }
+        cs.start  = (uint16_t)strtol(argv[2], NULL, 0);
+        cs.end    = (uint16_t)strtol(argv[3], NULL, 0);
+        cs.offset = (uint16_t)strtol(argv[4], NULL, 0);
+        cs.alg    = MY_DEV_CSUM_SUM16_BE;
+        for( int i = 5; i < argc; i++ )
+        {
+            if( strcmp(argv[i], "fix") == 0 )
+            {
+                cs.flags |= MY_DEV_CSUM_F_FIX;
+                continue;
+            }
+            cs.alg = 0xFF;
+            for( int a = 0; a < (int)(sizeof(algs) / sizeof(algs[0])); a++ )
+                if( strcmp(argv[i], algs[a]) == 0 )
+                    cs.alg = a;
+            if( cs.alg == 0xFF )
+            {
+                printf("Unknown checksum algorithm: %s\n", argv[i]);
+                return -1;
+            }
+        }
+    }
+
+    if( ioctl(fd, verify ? MY_DEV_CSUM_VERIFY : MY_DEV_CSUM_SET, &cs) != 0 )
+    {
+        printf("Failed to %s checksum region of MY_DEV\n", verify ? "verify" : "set");
+        return -1;
+    }
+
+    if( verify )
+    {
+        printf("%s of %02x-%02x at %02x: computed %04x, stored %04x: %s\n", algs[cs.alg], cs.start, cs.end,
+               cs.offset, cs.computed, cs.stored, (cs.computed == cs.stored) ? "ok" : "MISMATCH");
+        return (cs.computed == cs.stored) ? 0 : 1;
+    }
+    return 0;
+}
+
+// kv get NAME | kv set NAME VALUE | kv del NAME | kv format
+//     named variables in the driver's NVRAM directory; VALUE is taken as text, get prints both
+static int do_kv(int fd, int argc, char *argv[])
+{
+    mydev_kv_t    kv;
+    unsigned long cmd = MY_DEV_KV_SET;
+    char         *sub = argv[2];
+
+    memset(&kv, 0, sizeof(kv));
+    if( strcmp(sub, "format") == 0 && argc == 3 )
+        kv.flags = MY_DEV_KV_F_FORMAT;
+    else if( argc >= 4 && strlen(argv[3]) <= MY_DEV_KV_NAME_MAX )
+    {
+        strcpy(kv.name, argv[3]);
+        if( strcmp(sub, "get") == 0 && argc == 4 )
+            cmd = MY_DEV_KV_GET;
+        else if( strcmp(sub, "del") == 0 && argc == 4 )
+            kv.flags = MY_DEV_KV_F_DELETE;
+        else if( strcmp(sub, "set") == 0 && argc == 5 && strlen(argv[4]) <= MY_DEV_KV_VALUE_MAX )
+        {
+            kv.len = (uint8_t)strlen(argv[4]);
+            memcpy(kv.value, argv[4], kv.len);
+        }
+        else
+            sub = NULL;
+    }
+    else
+        sub = NULL;
+
+    if( !sub )
+    {
+        printf("Bad argument list for kv (names and values are at most %d bytes)\n", MY_DEV_KV_NAME_MAX);
+        return -1;
+    }
+
+    if( ioctl(fd, cmd, &kv) != 0 )
+    {
+        perror("kv");
+        return -1;
+    }
+
+    if( cmd == MY_DEV_KV_GET )
+    {
+        printf("%s = \"%.*s\" (", kv.name, kv.len, (char *)kv.value);
+        for( int i = 0; i < kv.len; i++ )
+            printf("%s%02x", i ? " " : "", kv.value[i]);
+        printf(")\n");
+    }
+    return 0;
+}
+
+// save/load image file: this header, then size bytes of data. Fields are little-endian; a
+// reader skips hdr_size bytes to reach the data, so later versions can grow the header.
+#define IMAGE_MAGIC   "MYDEVNV"
+#define IMAGE_VERSION 1
+
+typedef struct image_file_hdr
+{
+    char     magic[8];          // IMAGE_MAGIC, NUL padded
+    uint16_t version;
+    uint16_t hdr_size;
+    uint32_t size;              // MY_DEV_NVRAM_SIZE
+    uint32_t crc32;             // of mask and data
+    uint32_t reserved;
+    uint64_t mask[MY_DEV_NVRAM_SIZE / 64];    // offsets the image carries
+} image_file_hdr_t;
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    crc = ~crc;
+    while( len-- )
+    {
+        crc ^= *p++;
+        for( int i = 0; i < 8; i++ )
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static uint32_t image_crc(const image_file_hdr_t *hdr, const uint8_t *data)
+{
+    return crc32_update(crc32_update(0, hdr->mask, sizeof(hdr->mask)), data, MY_DEV_NVRAM_SIZE);
+}
+
+// save FILE [hw] -- whole NVRAM image in one MY_DEV_SNAPSHOT, less the live RTC registers;
+//     hw re-reads every byte from the ports instead of trusting the driver's shadow
+static int do_save(int fd, const char *path, int hw)
+{
+    mydev_image_t    img;
+    image_file_hdr_t hdr;
+
+    memset(&img, 0, sizeof(img));
+    img.flags = hw ? MY_DEV_IMAGE_F_HW : 0;
+    if( ioctl(fd, MY_DEV_SNAPSHOT, &img) != 0 )
+    {
+        printf("Failed to snapshot MY_DEV\n");
+        return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+    hdr.version  = IMAGE_VERSION;
+    hdr.hdr_size = sizeof(hdr);
+    hdr.size     = MY_DEV_NVRAM_SIZE;
+    memcpy(hdr.mask, img.mask, sizeof(hdr.mask));
+    hdr.crc32 = image_crc(&hdr, img.data);
+
+    FILE *f = fopen(path, "wb");
+    if( !f || fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(img.data, MY_DEV_NVRAM_SIZE, 1, f) != 1 || fclose(f) != 0 )
+    {
+        printf("Failed to write %s\n", path);
+        return -1;
+    }
+    printf("Saved %d bytes to %s\n", MY_DEV_NVRAM_SIZE, path);
+    return 0;
+}
+
+// load FILE -- one MY_DEV_RESTORE; the driver writes only the bytes that differ
+static int do_load(int fd, const char *path)
+{
+    mydev_image_t    img;
+    image_file_hdr_t hdr;
+    int              ok;
+
+    memset(&img, 0, sizeof(img));
+    FILE *f = fopen(path, "rb");
+    if( !f )
+    {
+        printf("Failed to open %s\n", path);
+        return -1;
+    }
+    ok = fread(&hdr, sizeof(hdr), 1, f) == 1 && memcmp(hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) == 0 &&
+         hdr.version == IMAGE_VERSION && hdr.hdr_size >= sizeof(hdr) && hdr.size == MY_DEV_NVRAM_SIZE &&
+         fseek(f, hdr.hdr_size, SEEK_SET) == 0 && fread(img.data, MY_DEV_NVRAM_SIZE, 1, f) == 1;
+    fclose(f);
+    if( !ok )
+    {
+        printf("%s is not a version %d NVRAM image\n", path, IMAGE_VERSION);
+        return -1;
+    }
+    if( image_crc(&hdr, img.data) != hdr.crc32 )
+    {
+        printf("%s is corrupt (CRC mismatch)\n", path);
+        return -1;
+    }
+
+    memcpy(img.mask, hdr.mask, sizeof(img.mask));
+    if( ioctl(fd, MY_DEV_RESTORE, &img) != 0 )
+    {
+        printf("Failed to restore MY_DEV\n");
+        return -1;
+    }
+    printf("Restored %s: %u bytes differed and were written\n", path, img.written);
+    return 0;
+}
+
+// Minimal io_uring, straight on the syscalls: one ring, submit a batch, reap the batch
+#define URING_DEPTH 256
+
+typedef struct uring
+{
+    int                  fd;
+    unsigned            *sq_tail, *sq_mask, *sq_array;
+    unsigned             sq_next;       // tail including queued, unpublished SQEs
+    struct io_uring_sqe *sqes;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} uring_t;
+
+static int uring_init(uring_t *ring)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring->fd = (int)syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+    if( ring->fd < 0 )
+        return -1;
+
+    // One mapping covers both rings on every kernel that has IORING_OP_URING_CMD
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t len    = (sq_len > cq_len) ? sq_len : cq_len;
+    uint8_t *rings = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->sqes     = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if( !(p.features & IORING_FEAT_SINGLE_MMAP) || rings == MAP_FAILED || ring->sqes == MAP_FAILED )
+    {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sq_tail  = (unsigned *)(rings + p.sq_off.tail);
+    ring->sq_mask  = (unsigned *)(rings + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(rings + p.sq_off.array);
+    ring->cq_head  = (unsigned *)(rings + p.cq_off.head);
+    ring->cq_tail  = (unsigned *)(rings + p.cq_off.tail);
+    ring->cq_mask  = (unsigned *)(rings + p.cq_off.ring_mask);
+    ring->cqes     = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+    ring->sq_next  = *ring->sq_tail;
+    return 0;
+}
+
+// Queue an IORING_OP_URING_CMD carrying cmd_op and its ioctl argument; published by uring_run
+static void uring_queue(uring_t *ring, int dev_fd, unsigned cmd_op, const void *arg, size_t len, uint64_t user_data)
+{
+    unsigned             idx  = ring->sq_next++ & *ring->sq_mask;
+    struct io_uring_sqe *sqe  = &ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode    = IORING_OP_URING_CMD;
+    sqe->fd        = dev_fd;
+    sqe->cmd_op    = cmd_op;
+    sqe->user_data = user_data;
+    memcpy(sqe->cmd, arg, len);
+    ring->sq_array[idx] = idx;
+}
+
+// Submit the n queued commands with one syscall, wait for all of them, res[user_data] = result
+static int uring_run(uring_t *ring, unsigned n, int *res)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_next, __ATOMIC_RELEASE);
+    if( syscall(__NR_io_uring_enter, ring->fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0) < 0 )
+        return -1;
+
+    unsigned head = *ring->cq_head;
+    for( unsigned done = 0; done < n; done++, head++ )
+    {
+        while( head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) )
+            ;   // GETEVENTS already waited for n; only a reordered tail update can get here
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        res[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// uring read|readhw OFFSET... | uring write OFFSET VALUE ... -- one io_uring_enter for all
+static int do_uring(int fd, int argc, char *argv[])
+{
+    uring_t      ring;
+    int          res[URING_DEPTH];
+    int          is_write = (strcmp(argv[2], "write") == 0);
+    unsigned     cmd      = is_write ? MY_DEV_WRITE : (strcmp(argv[2], "readhw") == 0) ? MY_DEV_READ_HW : MY_DEV_READ;
+    int          step     = is_write ? 2 : 1;
+    unsigned     n        = 0;
+
+    if( argc < 4 || (is_write && (argc - 3) % 2) || (argc - 3) / step > URING_DEPTH )
+    {
+        printf("Bad uring arguments\n");
+        return -1;
+    }
+    if( uring_init(&ring) != 0 )
+    {
+        printf("io_uring setup failed\n");
         return -1;
     }
 
-    if( strcmp(action, "read") == 0)
+    for( int i = 3; i < argc; i += step, n++ )
     {
-        if( ioctl(fd, MY_DEV_READ, &dev_data) != 0 )
+        mydev_data_t arg = { .data = 0, .offset = (uint32_t)strtol(argv[i], NULL, 0) };
+        if( is_write )
+            arg.data = (uint8_t)strtol(argv[i + 1], NULL, 0);
+        uring_queue(&ring, fd, cmd, &arg, sizeof(arg), n);
+    }
+
+    if( uring_run(&ring, n, res) != 0 )
+    {
+        printf("io_uring_enter failed\n");
+        close(ring.fd);
+        return -1;
+    }
+
+    for( unsigned i = 0; i < n; i++ )
+    {
+        const char *offset = argv[3 + i * step];
+        if( res[i] < 0 )
+            printf("URING: %x, Offset %s: error %d\n", cmd, offset, res[i]);
+        else if( is_write )
+            printf("URING: %x, Offset %s: written\n", cmd, offset);
+        else
+            printf("URING: %x, Offset %s: %02x\n", cmd, offset, res[i]);
+    }
+
+    close(ring.fd);
+    return 0;
+}
+
+static double now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// uringbench [SECONDS] [BATCH] -- cached MY_DEV_READs: one ioctl each vs BATCH per io_uring_enter
+static int do_uringbench(int fd, int seconds, unsigned batch)
+{
+    uring_t  ring;
+    int      res[URING_DEPTH];
+    uint64_t ops;
+    double   start, elapsed;
+
+    if( batch < 1 || batch > URING_DEPTH || seconds < 1 )
+    {
+        printf("Bad duration or batch size (1-%d)\n", URING_DEPTH);
+        return -1;
+    }
+    if( uring_init(&ring) != 0 )
+    {
+        printf("io_uring setup failed\n");
+        return -1;
+    }
+
+    ops   = 0;
+    start = now_sec();
+    do
+    {
+        for( int i = 0; i < 1000; i++, ops++ )
+        {
+            mydev_data_t arg = { .data = 0, .offset = MY_DEV_BANK1_BASE + (ops & (MY_DEV_BANK_SIZE - 1)) };
+            if( ioctl(fd, MY_DEV_READ, &arg) != 0 )
+            {
+                printf("ioctl failed\n");
+                close(ring.fd);
+                return -1;
+            }
+        }
+    } while( (elapsed = now_sec() - start) < seconds );
+    printf("ioctl:        %12.0f ops/s\n", ops / elapsed);
+    double base = ops / elapsed;
+
+    ops   = 0;
+    start = now_sec();
+    do
+    {
+        for( unsigned i = 0; i < batch; i++ )
+        {
+            mydev_data_t arg = { .data = 0, .offset = MY_DEV_BANK1_BASE + ((ops + i) & (MY_DEV_BANK_SIZE - 1)) };
+            uring_queue(&ring, fd, MY_DEV_READ, &arg, sizeof(arg), i);
+        }
+        if( uring_run(&ring, batch, res) != 0 || res[0] < 0 )
+        {
+            printf("io_uring_enter failed\n");
+            close(ring.fd);
+            return -1;
+        }
+        ops += batch;
+    } while( (elapsed = now_sec() - start) < seconds );
+    printf("uring x%-5u: %12.0f ops/s (%.2fx)\n", batch, ops / elapsed, ops / elapsed / base);
+
+    close(ring.fd);
+    return 0;
+}
+
+// setbits|clearbits|togglebits OFFSET MASK, cmpxchg OFFSET EXPECTED NEW -- one atomic ioctl
+static int do_rmw(cmos_t *h, char* action, int argc, char *argv[])
+{
+    static const struct { const char *name; unsigned op; } rmw_cmds[] = {
+        { "setbits",    MY_DEV_OP_SET_BITS    },
+        { "clearbits",  MY_DEV_OP_CLEAR_BITS  },
+        { "togglebits", MY_DEV_OP_TOGGLE_BITS },
+        { "cmpxchg",    MY_DEV_OP_CMPXCHG     },
+    };
+    unsigned    op = 0;
+    mydev_rmw_t rmw;
+
+    for( size_t i = 0; i < sizeof(rmw_cmds) / sizeof(rmw_cmds[0]); i++ )
+        if( strcmp(action, rmw_cmds[i].name) == 0 )
+            op = rmw_cmds[i].op;
+
+    if( argc != ((op == MY_DEV_OP_CMPXCHG) ? 5 : 4) )
+    {
+        printf("Bad argument list for %s\n", action);
+        return -1;
+    }
+
+    memset(&rmw, 0, sizeof(rmw));
+    rmw.offset = (uint32_t)strtol(argv[2], NULL, 0);
+    if( op == MY_DEV_OP_CMPXCHG )
+    {
+        rmw.expected = (uint8_t)strtol(argv[3], NULL, 0);
+        rmw.data     = (uint8_t)strtol(argv[4], NULL, 0);
+    }
+    else
+        rmw.mask = (uint8_t)strtol(argv[3], NULL, 0);
+
+    if( cmos_rmw(h, op, &rmw) != 0 )
+    {
+        printf("Failed to %s MY_DEV\n", action);
+        return -1;
+    }
+
+    printf("%s: Offset %04x: %02x, before %s\n", cmos_path_name(cmos_last_path(h)), rmw.offset, rmw.old, action);
+    if( op == MY_DEV_OP_CMPXCHG && rmw.old != rmw.expected )
+    {
+        printf("Compare failed, nothing written\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int is_rmw(const char *action)
+{
+    return strcmp(action, "setbits") == 0 || strcmp(action, "clearbits") == 0 ||
+           strcmp(action, "togglebits") == 0 || strcmp(action, "cmpxchg") == 0;
+}
+
+// Modes that are ioctls of their own: the driver has to be there
+static int need_fd(cmos_t *h, const char *mode)
+{
+    if( cmos_fd(h) < 0 )
+        printf("%s needs the %s driver\n", mode, DEV_NAME);
+    return cmos_fd(h);
+}
+
+static int run(cmos_t *h, int argc, char *argv[])
+{
+    if( (argc >= 3 && strcmp(argv[1], "uring") == 0) || (argc >= 2 && strcmp(argv[1], "uringbench") == 0) )
+    {
+        int fd = need_fd(h, argv[1]);
+        if( fd < 0 )
+            return -1;
+        return (strcmp(argv[1], "uring") == 0) ? do_uring(fd, argc, argv) :
+               do_uringbench(fd, (argc > 2) ? (int)strtol(argv[2], NULL, 0) : 2,
+                             (argc > 3) ? (unsigned)strtol(argv[3], NULL, 0) : 64);
+    }
+
+    if( argc >= 3 && strcmp(argv[1], "watch") == 0 )
+        return (need_fd(h, argv[1]) < 0) ? -1 : do_watch(cmos_fd(h), argc, argv);
+
+    if( argc >= 3 && (strcmp(argv[1], "save") == 0 || strcmp(argv[1], "load") == 0) )
+    {
+        int fd = need_fd(h, argv[1]);
+        if( fd < 0 )
+            return -1;
+        return (strcmp(argv[1], "save") == 0) ? do_save(fd, argv[2], argc > 3 && strcmp(argv[3], "hw") == 0) :
+               do_load(fd, argv[2]);
+    }
+
+    if( argc >= 3 && strcmp(argv[1], "kv") == 0 )
+        return (need_fd(h, argv[1]) < 0) ? -1 : do_kv(cmos_fd(h), argc, argv);
+
+    if( argc >= 3 && strcmp(argv[1], "csum") == 0 )
+        return (need_fd(h, argv[1]) < 0) ? -1 : do_csum(cmos_fd(h), argc, argv);
+
+    if( argc >= 2 && strcmp(argv[1], "rtc") == 0 )
+        return (need_fd(h, argv[1]) < 0) ? -1 : do_rtc(cmos_fd(h), (argc > 2) ? (int)strtol(argv[2], NULL, 0) : 1);
+
+    if( argc >= 2 && strcmp(argv[1], "flush") == 0 )
+    {
+        // Land writes the driver is holding back in write-back mode
+        if( cmos_flush(h) != 0 )
+        {
+            printf("Failed to flush MY_DEV\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if( argc >= 2 && strcmp(argv[1], "snapshot") == 0 )
+        return do_snapshot(h, (argc > 2) ? (int)strtol(argv[2], NULL, 0) : 1);
+
+    char* action = argv[1];
+    if( strcmp(action, "readv") == 0 || strcmp(action, "writev") == 0 )
+        return do_vec(h, action, argc, argv);
+    if( is_rmw(action) )
+        return do_rmw(h, action, argc, argv);
+
+    if( argc > 4 )
+    {
+        printf("Too many arguments supplied: %d\n", argc);
+        return -1;
+    }
+
+    uint32_t offset = (uint32_t)strtol(argv[2], NULL, 0);   // argv[2] = 0x????
+    uint8_t  data   = 0;
+
+    if( strcmp(action, "read") == 0 || strcmp(action, "readhw") == 0 )
+    {
+        // readhw skips the driver's shadow and re-reads the port
+        int ret = (strcmp(action, "readhw") == 0) ? cmos_read_hw(h, offset, &data) : cmos_read(h, offset, &data);
+        if( ret != 0 )
         {
             printf("Failed to read from MY_DEV\n");
             return -1;
         }
 
-        printf("IOCTL: %lx, Offset %04x: %02x\n", MY_DEV_READ, dev_data.offset, dev_data.data);
+        printf("%s: Offset %04x: %02x\n", cmos_path_name(cmos_last_path(h)), offset, data);
     }
     else
     {
-        dev_data.data = (uint8_t)strtol(argv[3], NULL, 0);
-        printf("IOCTL: %lx, Offset %04x: %02x\n", MY_DEV_WRITE, dev_data.offset, dev_data.data);
-        if( ioctl(fd, MY_DEV_WRITE, &dev_data) != 0 )
+        if( argc < 4 )
+        {
+            printf("Missing value to write\n");
+            return -1;
+        }
+
+        data = (uint8_t)strtol(argv[3], NULL, 0);
+        if( cmos_write(h, offset, data) != 0 )
         {
             printf("Failed to write to MY_DEV\n");
             return -1;
         }
+        printf("%s: Offset %04x: %02x\n", cmos_path_name(cmos_last_path(h)), offset, data);
     }
 
-    close(fd);
     return 0;
 }
 
+int main(int argc, char *argv[])
+{
+    if( argc >= 2 && strcmp(argv[1], "nmi") == 0 )
+        return do_nmi((argc > 2) ? (int)strtol(argv[2], NULL, 0) : 1);
+
+    if( argc >= 2 && strcmp(argv[1], "listen") == 0 )
+        return do_listen((argc > 2) ? (int)strtol(argv[2], NULL, 0) : 0);
+
+    if( argc < 3 && !(argc == 2 && (strcmp(argv[1], "uringbench") == 0 || strcmp(argv[1], "rtc") == 0 ||
+                                    strcmp(argv[1], "flush") == 0 || strcmp(argv[1], "snapshot") == 0)) )
+    {
+        printf("Usage: %s read|readhw|write|readv|writev OFFSET [VALUE] ...\n"
+               "       %s setbits|clearbits|togglebits OFFSET MASK | cmpxchg OFFSET EXPECTED NEW\n"
+               "       %s uring read|readhw OFFSET... | uring write OFFSET VALUE ... | uringbench [SECONDS] [BATCH]\n"
+               "       %s snapshot [COUNT] | nmi [COUNT] | listen [COUNT] | rtc [COUNT] | watch OFFSET... | flush\n"
+               "       %s csum START END OFFSET [sum16be|sum16le|sum8|xor8|none] [fix] | csum verify\n"
+               "       %s kv get NAME | kv set NAME VALUE | kv del NAME | kv format\n"
+               "       %s save FILE [hw] | load FILE\n", argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
+        return -1;
+    }
+
+    cmos_t *h = cmos_open(NULL, 0);
+    if( !h )
+    {
+        perror(cmos_default_path());
+        return -1;
+    }
+
+    int ret = run(h, argc, argv);
+    cmos_close(h);
+    return ret;
+}
+
 /**************************************************************************************************
 $ modprobe cmos_dev
 [  144.936922] my_dev_init
@@ -87,7 +949,8 @@ $ /sys/class/my-dev-class/my-dev# ls *
 dev  uevent
 
 my-dev-attrs:
-my_attr_7e  my_attr_7f
+bank            cache_hw_reads  my_attr_7e  nmi_dropped  wb_writes
+cache_hits      my_attr_7d      my_attr_7f  wb_elided
 
 power:
 autosuspend_delay_ms  runtime_active_time  runtime_suspended_time
@@ -117,42 +980,113 @@ ff
 /sys/class/my-dev-class/my-dev/my-dev-attrs$ cat my_attr_7f
 aa
 
+/sys/class/my-dev-class/my-dev/my-dev-attrs$ echo 0xaa > my_attr_7f       # hex works too
+
+/sys/class/my-dev-class/my-dev/my-dev-attrs$ xxd bank                     # both banks, one read
+
 $ grep my-dev /proc/ioports
   0072-0073 : my-dev-drv
 
-$ cat /dev/my-dev 
-[  163.709637] my_dev_open -- inode:0000000042c4a9f4, file:00000000c5bc3398
-[  163.731502] my_dev_read -- count:131072, offset:0
-[  163.736206] my_dev_read -- count:131072, offset:15
-My device read
-[  163.744129] my_dev_release -- inode:0000000042c4a9f4, file:00000000c5bc3398
-
-$ echo quit > /dev/my-dev 
-[  218.314087] my_dev_open -- inode:0000000042c4a9f4, file:0000000012204cf8
-[  218.320781] my_dev_ioctl -- ioctl:5401, offset:0, data:0
-[  218.326081] my_dev_ioctl -- unsupported ioctl: 21505
-[  218.345032] my_dev_write -- count:5, offset:0
-[  218.349379] CMD q received
-[  218.355483] my_dev_release -- inode:0000000042c4a9f4, file:0000000012204cf8
-
-$ echo exit > /dev/my-dev 
-[  249.767057] my_dev_open -- inode:0000000042c4a9f4, file:00000000e5760fd2
-[  249.773749] my_dev_write -- count:5, offset:0
-[  249.778097] CMD unknown
-[  249.780785] my_dev_release -- inode:0000000042c4a9f4, file:00000000e5760fd2
-
-$ ./cmos_dev_user write 0x7F 0xaa
-[ 1156.578781] my_dev_open -- inode:000000005c305211, file:0000000085eee9c1
-IOCTL: 40084601,[ 1156.601437] my_dev_ioctl -- ioctl:40084601, offset:7f, data:aa
- Offset 007f: aa[ 1156.608634] my_dev_release -- inode:000000005c305211, file:0000000085eee9c1
-
-$ ./cmos_dev_user read 0x7F
-[ 1172.878909] my_dev_open -- inode:000000005c305211, file:000000003873d0bb
-[ 1172.886972] my_dev_ioctl -- ioctl:80084600, offset:7f, data:0
-IOCTL: 80084600,[ 1172.893775] my_dev_release -- inode:000000005c305211, file:000000003873d0bb
- Offset 007f: aa
-
-$ in /var/syslog
-[ 1653.675441] My nmi_test, addr 0x7F:xaa, addr 0x7E:xff, addr 0x7D:xbb
+Offsets 0x00-0x7F are bank 0 (ports 0x70/0x71, RTC registers first) and 0x80-0xFF are bank 1
+(ports 0x72/0x73); my_attr_7d..7f keep their bank 1 meaning, i.e. offsets 0xFD-0xFF.
+/dev/my-dev reads and writes as a 256-byte file over both banks, so standard tools work:
+$ xxd /dev/my-dev                                            # dump both banks in one read()
+$ dd if=/dev/my-dev bs=1 skip=$((0xfe)) count=2 | xxd        # bank 1 bytes 0x7E-0x7F
+$ printf '\xaa' | dd of=/dev/my-dev bs=1 seek=$((0xff)) conv=notrunc
+
+Each run goes through libcmos, which names the path it took; cached reads come straight from
+the mapped shadow page without a syscall:
+$ ./cmos_dev_user write 0xFF 0xaa
+ioctl: Offset 00ff: aa
+
+$ ./cmos_dev_user read 0xFF
+mmap: Offset 00ff: aa
+
+$ rmmod cmos_dev; ./cmos_dev_user read 0xFF              # no driver: bank 1 on the ports
+ports: Offset 00ff: aa
+
+open/release and single byte ioctls are tracepoints rather than log lines:
+$ echo 1 > /sys/kernel/tracing/events/cmos_dev/enable
+$ ./cmos_dev_user readhw 0xFF; cat /sys/kernel/tracing/trace
+  cmos_dev_user-1412 [002] ..... 1172.878909: my_dev_open: minor:0 file:000000003873d0bb
+  cmos_dev_user-1412 [002] ..... 1172.886972: my_dev_ioctl: ioctl:c0084604 offset:ff data:0
+  cmos_dev_user-1412 [002] ..... 1172.893775: my_dev_release: minor:0 file:000000003873d0bb
+
+Latency histograms and counters are in debugfs:
+$ cat /sys/kernel/debug/my-dev/latency
+ioctl: count 2, avg 3412 ns
+          2048 ns+ 1
+          4096 ns+ 1
+port_read: count 242, avg 1391 ns
+          1024 ns+ 242
+...
+$ echo 1 > /sys/kernel/debug/my-dev/reset
+
+NMIs are recorded in a per-CPU ring rather than logged; drain it through /dev/my-dev-nmi:
+$ ./cmos_dev_user nmi 1
+
+Wait for NVRAM changes instead of polling the attribute files. Writes through the driver are
+reported at once. Changes made behind its back are only seen with the sampler on, within
+sample_ms (module parameter, off by default):
+$ modprobe cmos_dev sample_ms=1000
+$ ./cmos_dev_user watch 0xFE 0xFF &
+$ ./cmos_dev_user write 0xFE 0x17
+Offset 00fe changed: 17
+Scripts can block on an attribute file instead, e.g. with poll(POLLPRI) on my_attr_7e.
+
+Daemons that all want every change, or the NMI events, join the driver's generic netlink
+groups instead: one batched message reaches every listener, and nobody holds a device open.
+Changes carry the old value and whether they came through the driver or from the port:
+$ ./cmos_dev_user listen &
+$ ./cmos_dev_user write 0xFE 0x18
+Instance 0 offset 00fe: 17 -> 18 (write)
+Instance 0 offset 00fd: 00 -> 01 (hw)
+NMI cpu 2 at 8123456789 ns: addr 0xFD:x01 addr 0xFE:x18 addr 0xFF:xaa
+
+The same commands through io_uring, many per syscall (the CQE carries the byte read):
+$ ./cmos_dev_user uring read 0xFD 0xFE 0xFF
+URING: 80084600, Offset 0xFD: 00
+URING: 80084600, Offset 0xFE: 17
+URING: 80084600, Offset 0xFF: aa
+$ ./cmos_dev_user uringbench 2 64
+ioctl:             2641309 ops/s
+uring x64   :      9815720 ops/s (3.72x)
+
+Keep the BIOS checksum current on every write instead of re-reading 0x10-0x2D after each one,
+then check it against the shadow (no port reads either way):
+$ ./cmos_dev_user csum 0x10 0x2D 0x2E sum16be
+$ ./cmos_dev_user write 0x20 0x01
+$ ./cmos_dev_user csum verify
+sum16be of 10-2d at 2e: computed 05e1, stored 05e1: ok
+
+Reprovision from a known-good image in one call instead of a run per byte; the restore only
+writes the bytes that differ (RTC registers 0x00-0x0D are never saved or restored):
+$ ./cmos_dev_user save golden.nv
+Saved 256 bytes to golden.nv
+$ ./cmos_dev_user load golden.nv
+Restored golden.nv: 3 bytes differed and were written
+
+Named variables instead of per-tool offset tables; the directory lives in bank 1 bytes
+0x00-0x6F, and the driver finds a name through a hash index rather than a scan:
+$ ./cmos_dev_user kv format
+$ ./cmos_dev_user kv set boot_mode fast
+$ ./cmos_dev_user kv get boot_mode
+boot_mode = "fast" (66 61 73 74)
+$ ./cmos_dev_user kv del boot_mode
+
+Several instances, each with its own backend, locks and shadow (backend is a list, one
+instance per entry; io_base moves a port instance's bank 1):
+$ modprobe cmos_dev backend=port,sim sim_latency_ns=1000
+$ ls /dev/my-dev*
+/dev/my-dev  /dev/my-dev-nmi  /dev/my-dev1
+$ MY_DEV=/dev/my-dev1 ./cmos_dev_user read 0xFF
+mmap: Offset 00ff: 00
+$ cat /sys/kernel/debug/my-dev1/counters
+
+RTC time without waiting out the update cycle; the driver times the RTC's second tick:
+$ ./cmos_dev_user rtc 3
+2024-05-14 09:26:41.532180 +/- 100 us, snapshot 532 ms old
+2024-05-14 09:26:41.632411 +/- 100 us, snapshot 632 ms old
+2024-05-14 09:26:41.732650 +/- 100 us, snapshot 732 ms old
 ****************************************************************************************************/
 
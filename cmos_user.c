@@ -10,14 +10,21 @@
  * Kernel  character device driver would work on any PCI-supporting architecture.
  * Can use UNIX permissions on the character device file to control user space access.
  * Kernel function request_region can ensure no IO port clashes with other driver.
+ *
+ * The accesses go through libcmos: through the cmos_dev driver when it is loaded (which
+ *     owns the ports then), else straight to the ports with one ioperm grant per run.
+ *     gcc -O2 -Wall -o cmos_user cmos_user.c libcmos.c
  ***********************************************************************************/
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <sys/io.h>       // ioperm
 #include <string.h>       // strcmp
 #include <stdint.h>       // uint32_t, etc
+#include <ctype.h>        // isspace
+#include <errno.h>
+
+#include "libcmos.h"
 
 /***********************************************************************************
  * CMOS: complementary metal-oxide semiconductor
@@ -36,58 +43,247 @@
  ***********************************************************************************/
 
 #define IO_RTC_BANK1_INDEX_PORT              0x72    // extended CMOS NVRAM
+#define IO_RTC_BANK1_SIZE                    0x80
+
+// addr is the bank 1 index; libcmos takes offsets over both banks
+#define EXT_CMOS(addr)                       (MY_DEV_BANK1_BASE + (addr))
+
+static inline int ext_cmos_read(cmos_t *h, unsigned char addr, uint8_t *val)
+{
+    return cmos_read(h, EXT_CMOS(addr), val);
+}
+
+static inline int ext_cmos_write(cmos_t *h, unsigned char addr, unsigned char val)
+{
+    return cmos_write(h, EXT_CMOS(addr), val);
+}
+
+/***********************************************************************************
+ * Batch mode: one libcmos handle (one ioperm grant) for a whole stream of commands, one
+ *     command per line
+ *     read       OFFSET
+ *     write      OFFSET VALUE
+ *     setbits    OFFSET MASK
+ *     clearbits  OFFSET MASK
+ *     togglebits OFFSET MASK
+ *     cmpxchg    OFFSET EXPECTED NEW
+ *     quit
+ * Blank lines and lines starting with '#' are skipped. Numbers take any strtol base.
+ *
+ * Each command prints exactly one line, flushed right away, so a script can keep the
+ *     process open as a co-process and read one reply per request:
+ *     ok   OFFSET OLD NEW       e.g. "ok 0x10 0x5a 0x5a" for a read
+ *     fail OFFSET OLD OLD       cmpxchg whose compare failed; nothing written
+ *     err  LINE MESSAGE         parse error; the stream goes on
+ * The exit status is non-zero if any line failed or erred.
+ *
+ *     printf 'read 0x10\nsetbits 0x10 0x80\n' | ./cmos_user batch
+ *     ./cmos_user batch cmds.txt
+ *     coproc CMOS { ./cmos_user batch; }; echo "read 0x10" >&${CMOS[1]}; read -u ${CMOS[0]} r
+ ***********************************************************************************/
+
+#define BATCH_MAX_ARGS                       4
+
+static int parse_u8(const char *s, uint32_t max, uint32_t *val)
+{
+    char *end;
+    long  v = strtol(s, &end, 0);
 
-static inline unsigned char ext_cmos_read(unsigned char addr)
+    if( end == s || *end != '\0' || v < 0 || (unsigned long)v > max )
+        return -1;
+    *val = (uint32_t)v;
+    return 0;
+}
+
+static const struct { const char *name; int nargs; unsigned op; } batch_cmds[] = {
+    { "read",       1, MY_DEV_OP_READ        },
+    { "write",      2, MY_DEV_OP_WRITE       },
+    { "setbits",    2, MY_DEV_OP_SET_BITS    },
+    { "clearbits",  2, MY_DEV_OP_CLEAR_BITS  },
+    { "togglebits", 2, MY_DEV_OP_TOGGLE_BITS },
+    { "cmpxchg",    3, MY_DEV_OP_CMPXCHG     },
+};
+
+// Returns 0 ok, 1 compare failed, -1 bad line (message already printed)
+static int batch_line(cmos_t *h, char *line, unsigned long lineno)
 {
-    outb(addr, IO_RTC_BANK1_INDEX_PORT);
-    return inb(IO_RTC_BANK1_INDEX_PORT + 1);
+    char     *argv[BATCH_MAX_ARGS + 1];
+    int       argc = 0;
+    int       cmd = -1;
+    uint32_t  arg[BATCH_MAX_ARGS] = { 0 };
+    uint8_t   val = 0;
+    char     *tok;
+    int       ret;
+
+    for( tok = strtok(line, " \t\r\n"); tok && argc <= BATCH_MAX_ARGS; tok = strtok(NULL, " \t\r\n") )
+        argv[argc++] = tok;
+    if( argc == 0 || argv[0][0] == '#' )
+        return 0;
+
+    for( size_t i = 0; i < sizeof(batch_cmds) / sizeof(batch_cmds[0]); i++ )
+        if( strcmp(argv[0], batch_cmds[i].name) == 0 )
+            cmd = (int)i;
+    if( cmd < 0 )
+    {
+        printf("err %lu unknown command %s\n", lineno, argv[0]);
+        return -1;
+    }
+    if( argc != batch_cmds[cmd].nargs + 1 )
+    {
+        printf("err %lu %s takes %d argument(s)\n", lineno, argv[0], batch_cmds[cmd].nargs);
+        return -1;
+    }
+    for( int i = 0; i < batch_cmds[cmd].nargs; i++ )
+    {
+        if( parse_u8(argv[i + 1], (i == 0) ? IO_RTC_BANK1_SIZE - 1 : 0xFF, &arg[i]) )
+        {
+            printf("err %lu bad %s %s\n", lineno, (i == 0) ? "offset" : "value", argv[i + 1]);
+            return -1;
+        }
+    }
+
+    // A write reports the byte it replaced: read and write as one batch, one driver lock hold
+    mydev_vec_entry_t rw[2] = {
+        { .offset = EXT_CMOS(arg[0]), .op = MY_DEV_OP_READ },
+        { .offset = EXT_CMOS(arg[0]), .op = MY_DEV_OP_WRITE, .data = (uint8_t)arg[1] },
+    };
+    mydev_rmw_t rmw = { .offset = EXT_CMOS(arg[0]), .mask = (uint8_t)arg[1],
+                        .expected = (uint8_t)arg[1], .data = (uint8_t)arg[2] };
+
+    switch( batch_cmds[cmd].op )
+    {
+    case MY_DEV_OP_READ:
+        ret = ext_cmos_read(h, arg[0], &rmw.old);
+        val = rmw.old;
+        break;
+    case MY_DEV_OP_WRITE:
+        ret = cmos_batch(h, rw, 2);
+        rmw.old = rw[0].data;
+        val     = rw[1].data;
+        break;
+    default:
+        ret = cmos_rmw(h, batch_cmds[cmd].op, &rmw);
+        val = (batch_cmds[cmd].op == MY_DEV_OP_SET_BITS)    ? (rmw.old | rmw.mask)  :
+              (batch_cmds[cmd].op == MY_DEV_OP_CLEAR_BITS)  ? (rmw.old & ~rmw.mask) :
+              (batch_cmds[cmd].op == MY_DEV_OP_TOGGLE_BITS) ? (rmw.old ^ rmw.mask)  : rmw.data;
+        break;
+    }
+
+    if( ret != 0 )
+    {
+        printf("err %lu %s\n", lineno, strerror(-ret));
+        return -1;
+    }
+    if( batch_cmds[cmd].op == MY_DEV_OP_CMPXCHG && rmw.old != rmw.expected )
+    {
+        printf("fail 0x%02x 0x%02x 0x%02x\n", arg[0], rmw.old, rmw.old);
+        return 1;
+    }
+    printf("ok 0x%02x 0x%02x 0x%02x\n", arg[0], rmw.old, val);
+    return 0;
 }
 
-static inline void ext_cmos_write(unsigned char addr, unsigned char val)
+static int do_batch(const char *path)
 {
-    outb(addr, IO_RTC_BANK1_INDEX_PORT);
-    outb(val, IO_RTC_BANK1_INDEX_PORT + 1);
+    FILE          *in = stdin;
+    char           line[256];
+    unsigned long  lineno = 0;
+    int            ret = 0;
+
+    if( path && strcmp(path, "-") != 0 && (in = fopen(path, "r")) == NULL )
+    {
+        printf("err 0 cannot open %s\n", path);
+        return -1;
+    }
+
+    // One reply per request, visible to the peer as soon as it is printed
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    cmos_t *h = cmos_open(NULL, 0);
+    if( !h )
+    {
+        printf("err 0 cannot get NVRAM access: %s\n", strerror(errno));
+        if( in != stdin )
+            fclose(in);
+        return -1;
+    }
+
+    while( fgets(line, sizeof(line), in) )
+    {
+        lineno++;
+        if( strchr(line, '\n') == NULL && !feof(in) )
+        {
+            int c;
+            while( (c = fgetc(in)) != EOF && c != '\n' )
+                ;
+            printf("err %lu line too long\n", lineno);
+            ret = -1;
+            continue;
+        }
+
+        char *p = line;
+        while( isspace((unsigned char)*p) )
+            p++;
+        if( strncmp(p, "quit", 4) == 0 && (p[4] == '\0' || isspace((unsigned char)p[4])) )
+            break;
+        if( batch_line(h, p, lineno) != 0 )
+            ret = -1;
+    }
+
+    cmos_close(h);
+    if( in != stdin )
+        fclose(in);
+    return ret;
 }
 
 int main(int argc, char *argv[])
 {
-    if( argc > 4 )
+    if( argc >= 2 && strcmp(argv[1], "batch") == 0 )
+        return do_batch((argc > 2) ? argv[2] : NULL);
+
+    if( argc > 4 || argc < 3 || (strcmp(argv[1], "read") != 0 && argc < 4) )
     {
-        printf("Too many arguments supplied: %d\n", argc);
+        printf("Usage: %s read OFFSET | write OFFSET VALUE | batch [FILE|-]\n", argv[0]);
         return -1;
     }
 
     char* action = argv[1];
     uint32_t offset = (uint32_t)strtol(argv[2], NULL, 0);   // argv[2] = 0x????
-    uint8_t data = 0;
+    uint8_t data = 0, before = 0, after = 0;
     printf("%s %s %d\n", argv[0], action, offset);
 
-    // Request access to the ports; avoid general protection fault
+    if( offset >= IO_RTC_BANK1_SIZE )
+    {
+        printf("Offset out of bank 1: %02x\n", offset);
+        return -1;
+    }
+
+    // The driver if it is loaded, else access to the ports; avoid general protection fault
     // Need root privileges
-    if (ioperm(IO_RTC_BANK1_INDEX_PORT, 2, 1))
+    cmos_t *h = cmos_open(NULL, 0);
+    if( !h )
     {
         printf("Error requesting IO port access");
         return -1;
     }
 
+    int ret = 0;
     if( strcmp(action, "read") == 0)
     {
-        printf("Offset %02x: %02hhx\n", offset, ext_cmos_read(offset));
+        if( (ret = ext_cmos_read(h, offset, &before)) == 0 )
+            printf("Offset %02x: %02hhx\n", offset, before);
     }
     else
     {
         data = (uint8_t)strtol(argv[3], NULL, 0);
-        printf("Offset %02x: %02hhx, before writing\n", offset, ext_cmos_read(offset));
-        ext_cmos_write(offset, data);
-        printf("Offset %02x: %02hhx, after writing\n", offset, ext_cmos_read(offset));
-    }
-
-    if (ioperm(IO_RTC_BANK1_INDEX_PORT, 2, 0))
-    {
-        printf("Error release IO ports");
-        return -1;
+        if( (ret = ext_cmos_read(h, offset, &before)) == 0 )
+            printf("Offset %02x: %02hhx, before writing\n", offset, before);
+        if( ret == 0 && (ret = ext_cmos_write(h, offset, data)) == 0 && (ret = ext_cmos_read(h, offset, &after)) == 0 )
+            printf("Offset %02x: %02hhx, after writing\n", offset, after);
     }
+    if( ret != 0 )
+        printf("Error accessing offset %02x: %s\n", offset, strerror(-ret));
 
-    return 0;
+    cmos_close(h);
+    return ret ? -1 : 0;
 }
-
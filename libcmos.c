@@ -0,0 +1,430 @@
+/******************************************************************************************
+ * libcmos: see libcmos.h
+ *****************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>       // getenv, calloc
+#include <fcntl.h>        // open
+#include <unistd.h>       // close
+#include <errno.h>
+#include <string.h>       // memcpy
+#include <sys/ioctl.h>    // ioctl
+#include <sys/mman.h>     // mmap
+#include <sys/io.h>       // ioperm, inb, outb
+
+#include "libcmos.h"
+
+#define CMOS_PORT_BANK1     0x72    // bank 1 index port, its data port follows
+#define CMOS_CACHE_PARAM    "/sys/module/cmos_dev/parameters/cache_reads"
+
+struct cmos
+{
+    int                        fd;      // -1 on the ports
+    unsigned                   paths;   // CMOS_PATH_*
+    unsigned                   last;
+    const mydev_shadow_page_t *page;    // CMOS_PATH_MMAP
+};
+
+const char *cmos_default_path(void)
+{
+    const char *path = getenv("MY_DEV");
+    return path ? path : "/dev/"DEV_NAME;
+}
+
+// The shadow page answers a read as MY_DEV_READ would only while the driver serves reads from
+// its shadow; with cache_reads=0 each read has to reach the port
+static int cmos_driver_caches(void)
+{
+    char  c = 'Y';
+    FILE *f = fopen(CMOS_CACHE_PARAM, "r");
+
+    if( f )
+    {
+        if( fread(&c, 1, 1, f) != 1 )
+            c = 'Y';
+        fclose(f);
+    }
+    return c != 'N';
+}
+
+cmos_t *cmos_open(const char *path, unsigned avoid)
+{
+    int     err = ENODEV;
+    cmos_t *h   = calloc(1, sizeof(*h));
+
+    if( !h )
+        return NULL;
+    h->fd = -1;
+
+    if( !(avoid & CMOS_PATH_IOCTL) )
+    {
+        h->fd = open(path ? path : cmos_default_path(), O_RDWR | O_CLOEXEC);
+        err   = errno;
+        if( h->fd < 0 && err != ENOENT && err != ENODEV && err != ENXIO )
+            goto fail;                  // the driver is there, we may not use it
+    }
+
+    if( h->fd >= 0 )
+    {
+        h->paths = CMOS_PATH_IOCTL | (CMOS_PATH_VEC & ~avoid);
+        if( !(avoid & CMOS_PATH_MMAP) && cmos_driver_caches() )
+        {
+            void *page = mmap(NULL, sizeof(*h->page), PROT_READ, MAP_SHARED, h->fd, 0);
+            if( page != MAP_FAILED )
+            {
+                h->page   = page;
+                h->paths |= CMOS_PATH_MMAP;
+            }
+        }
+        return h;
+    }
+
+    // No driver: the ports, as long as nobody else owns them
+    if( avoid & CMOS_PATH_PORTS )
+        goto fail;
+    if( ioperm(CMOS_PORT_BANK1, 2, 1) )
+    {
+        err = errno;
+        goto fail;
+    }
+    h->paths = CMOS_PATH_PORTS;
+    return h;
+
+fail:
+    free(h);
+    errno = err;
+    return NULL;
+}
+
+void cmos_close(cmos_t *h)
+{
+    if( !h )
+        return;
+    if( h->page )
+        munmap((void *)h->page, sizeof(*h->page));
+    if( h->fd >= 0 )
+        close(h->fd);
+    if( h->paths & CMOS_PATH_PORTS )
+        ioperm(CMOS_PORT_BANK1, 2, 0);
+    free(h);
+}
+
+unsigned cmos_paths(const cmos_t *h)
+{
+    return h->paths;
+}
+
+unsigned cmos_last_path(const cmos_t *h)
+{
+    return h->last;
+}
+
+const char *cmos_path_name(unsigned path)
+{
+    switch( path )
+    {
+    case CMOS_PATH_MMAP:  return "mmap";
+    case CMOS_PATH_VEC:   return "vec";
+    case CMOS_PATH_IOCTL: return "ioctl";
+    case CMOS_PATH_PORTS: return "ports";
+    default:              return "none";
+    }
+}
+
+int cmos_fd(const cmos_t *h)
+{
+    return h->fd;
+}
+
+/******************************************************************************************
+ * Paths
+ *****************************************************************************************/
+
+static int cmos_ioctl(cmos_t *h, unsigned long cmd, void *arg)
+{
+    h->last = CMOS_PATH_IOCTL;
+    return ioctl(h->fd, cmd, arg) ? -errno : 0;
+}
+
+// Bytes the shadow page holds: everything the driver caches, i.e. all but the RTC registers
+static int cmos_cached(const cmos_t *h, uint32_t offset)
+{
+    return (h->paths & CMOS_PATH_MMAP) && offset >= MY_DEV_RTC_REGS && offset < h->page->size;
+}
+
+// The driver keeps a bank's seq odd while it updates that bank; a copy is good if even seqs,
+// unchanged, bracket it
+static void cmos_shadow_begin(const mydev_shadow_page_t *page, uint32_t *seq)
+{
+    for( int b = 0; b < MY_DEV_NUM_BANKS; b++ )
+        while( (seq[b] = __atomic_load_n(&page->seq[b], __ATOMIC_ACQUIRE)) & 1 )
+            ;
+}
+
+static int cmos_shadow_retry(const mydev_shadow_page_t *page, const uint32_t *seq)
+{
+    int retry = 0;
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    for( int b = 0; b < MY_DEV_NUM_BANKS; b++ )
+        retry |= __atomic_load_n(&page->seq[b], __ATOMIC_RELAXED) != seq[b];
+    return retry;
+}
+
+static int cmos_port_check(uint32_t offset)
+{
+    return (offset >= MY_DEV_BANK1_BASE && offset < MY_DEV_NVRAM_SIZE) ? 0 : -EOPNOTSUPP;
+}
+
+static uint8_t cmos_port_read(cmos_t *h, uint32_t offset)
+{
+    h->last = CMOS_PATH_PORTS;
+    outb(offset - MY_DEV_BANK1_BASE, CMOS_PORT_BANK1);
+    return inb(CMOS_PORT_BANK1 + 1);
+}
+
+static void cmos_port_write(cmos_t *h, uint32_t offset, uint8_t val)
+{
+    h->last = CMOS_PATH_PORTS;
+    outb(offset - MY_DEV_BANK1_BASE, CMOS_PORT_BANK1);
+    outb(val, CMOS_PORT_BANK1 + 1);
+}
+
+/******************************************************************************************
+ * Single bytes
+ *****************************************************************************************/
+
+int cmos_read(cmos_t *h, uint32_t offset, uint8_t *val)
+{
+    mydev_data_t d = { .data = 0, .offset = offset };
+    int          ret;
+
+    if( offset >= MY_DEV_NVRAM_SIZE )
+        return -EINVAL;
+
+    if( cmos_cached(h, offset) )
+    {
+        // One byte can't tear, so no need for the seqs
+        h->last = CMOS_PATH_MMAP;
+        *val    = __atomic_load_n(&h->page->nvram[offset], __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if( h->paths & CMOS_PATH_PORTS )
+    {
+        if( (ret = cmos_port_check(offset)) == 0 )
+            *val = cmos_port_read(h, offset);
+        return ret;
+    }
+
+    if( (ret = cmos_ioctl(h, MY_DEV_READ, &d)) == 0 )
+        *val = d.data;
+    return ret;
+}
+
+int cmos_read_hw(cmos_t *h, uint32_t offset, uint8_t *val)
+{
+    mydev_data_t d = { .data = 0, .offset = offset };
+    int          ret;
+
+    if( offset >= MY_DEV_NVRAM_SIZE )
+        return -EINVAL;
+
+    if( h->paths & CMOS_PATH_PORTS )
+    {
+        if( (ret = cmos_port_check(offset)) == 0 )
+            *val = cmos_port_read(h, offset);
+        return ret;
+    }
+
+    if( (ret = cmos_ioctl(h, MY_DEV_READ_HW, &d)) == 0 )
+        *val = d.data;
+    return ret;
+}
+
+int cmos_write(cmos_t *h, uint32_t offset, uint8_t val)
+{
+    mydev_data_t d = { .data = val, .offset = offset };
+    int          ret;
+
+    if( offset >= MY_DEV_NVRAM_SIZE )
+        return -EINVAL;
+
+    if( h->paths & CMOS_PATH_PORTS )
+    {
+        if( (ret = cmos_port_check(offset)) == 0 )
+            cmos_port_write(h, offset, val);
+        return ret;
+    }
+
+    return cmos_ioctl(h, MY_DEV_WRITE, &d);
+}
+
+int cmos_rmw(cmos_t *h, unsigned op, mydev_rmw_t *rmw)
+{
+    static const unsigned long rmw_cmds[] = {
+        [MY_DEV_OP_SET_BITS]    = MY_DEV_SET_BITS,
+        [MY_DEV_OP_CLEAR_BITS]  = MY_DEV_CLEAR_BITS,
+        [MY_DEV_OP_TOGGLE_BITS] = MY_DEV_TOGGLE_BITS,
+        [MY_DEV_OP_CMPXCHG]     = MY_DEV_CMPXCHG,
+    };
+    int ret;
+
+    if( op < MY_DEV_OP_SET_BITS || op > MY_DEV_OP_CMPXCHG || rmw->offset >= MY_DEV_NVRAM_SIZE )
+        return -EINVAL;
+
+    if( !(h->paths & CMOS_PATH_PORTS) )
+        return cmos_ioctl(h, rmw_cmds[op], rmw);
+
+    if( (ret = cmos_port_check(rmw->offset)) != 0 )
+        return ret;
+
+    rmw->old = cmos_port_read(h, rmw->offset);
+    switch( op )
+    {
+    case MY_DEV_OP_SET_BITS:    cmos_port_write(h, rmw->offset, rmw->old | rmw->mask);   break;
+    case MY_DEV_OP_CLEAR_BITS:  cmos_port_write(h, rmw->offset, rmw->old & ~rmw->mask);  break;
+    case MY_DEV_OP_TOGGLE_BITS: cmos_port_write(h, rmw->offset, rmw->old ^ rmw->mask);   break;
+    case MY_DEV_OP_CMPXCHG:
+        if( rmw->old == rmw->expected )
+            cmos_port_write(h, rmw->offset, rmw->data);
+        break;
+    }
+    return 0;
+}
+
+/******************************************************************************************
+ * Batches and ranges
+ *****************************************************************************************/
+
+// One entry on its own, for drivers without MY_DEV_READV and for the ports
+static int cmos_batch_one(cmos_t *h, mydev_vec_entry_t *e)
+{
+    mydev_rmw_t rmw = { .offset = e->offset, .mask = e->data };
+    int         ret;
+
+    switch( e->op )
+    {
+    case MY_DEV_OP_READ:    return cmos_read(h, e->offset, &e->data);
+    case MY_DEV_OP_READ_HW: return cmos_read_hw(h, e->offset, &e->data);
+    case MY_DEV_OP_WRITE:   return cmos_write(h, e->offset, e->data);
+    default:
+        if( (ret = cmos_rmw(h, e->op, &rmw)) == 0 )
+            e->data = rmw.old;
+        return ret;
+    }
+}
+
+int cmos_batch(cmos_t *h, mydev_vec_entry_t *entries, size_t count)
+{
+    uint32_t seq[MY_DEV_NUM_BANKS];
+    int      shadow = (count != 0);
+    int      ret;
+
+    // Check everything first so a bad entry never leaves a batch half done, as the driver does
+    for( size_t i = 0; i < count; i++ )
+    {
+        if( entries[i].offset >= MY_DEV_NVRAM_SIZE || entries[i].op > MY_DEV_OP_TOGGLE_BITS )
+            return -EINVAL;
+        if( (h->paths & CMOS_PATH_PORTS) && (ret = cmos_port_check(entries[i].offset)) != 0 )
+            return ret;
+        if( entries[i].op != MY_DEV_OP_READ || !cmos_cached(h, entries[i].offset) )
+            shadow = 0;
+    }
+
+    // Plain cached reads: a consistent copy out of the shadow page, as MY_DEV_READV would make
+    if( shadow )
+    {
+        h->last = CMOS_PATH_MMAP;
+        do
+        {
+            cmos_shadow_begin(h->page, seq);
+            for( size_t i = 0; i < count; i++ )
+                entries[i].data = h->page->nvram[entries[i].offset];
+        } while( cmos_shadow_retry(h->page, seq) );
+        return 0;
+    }
+
+    size_t done = 0;
+    while( (h->paths & CMOS_PATH_VEC) && done < count )
+    {
+        mydev_vec_t vec;
+
+        vec.entries  = (uint64_t)(uintptr_t)(entries + done);
+        vec.count    = (count - done < MY_DEV_VEC_MAX) ? count - done : MY_DEV_VEC_MAX;
+        vec.reserved = 0;
+        h->last      = CMOS_PATH_VEC;
+        if( ioctl(h->fd, MY_DEV_READV, &vec) != 0 )
+        {
+            if( errno != ENOTTY || done )
+                return -errno;
+            h->paths &= ~CMOS_PATH_VEC;     // a driver from before MY_DEV_READV
+            break;
+        }
+        done += vec.count;
+    }
+
+    for( ; done < count; done++ )
+        if( (ret = cmos_batch_one(h, &entries[done])) != 0 )
+            return ret;
+    return 0;
+}
+
+static int cmos_range(cmos_t *h, uint32_t offset, uint8_t *buf, size_t count, uint8_t op)
+{
+    mydev_vec_entry_t entries[MY_DEV_VEC_MAX];
+    size_t            n;
+    int               ret;
+
+    if( offset > MY_DEV_NVRAM_SIZE || count > MY_DEV_NVRAM_SIZE - offset )
+        return -EINVAL;
+
+    for( size_t done = 0; done < count; done += n )
+    {
+        n = (count - done < MY_DEV_VEC_MAX) ? count - done : MY_DEV_VEC_MAX;
+        for( size_t i = 0; i < n; i++ )
+        {
+            entries[i].offset   = offset + done + i;
+            entries[i].data     = (op == MY_DEV_OP_WRITE) ? buf[done + i] : 0;
+            entries[i].op       = op;
+            entries[i].reserved = 0;
+        }
+        if( (ret = cmos_batch(h, entries, n)) != 0 )
+            return ret;
+        if( op == MY_DEV_OP_READ )
+            for( size_t i = 0; i < n; i++ )
+                buf[done + i] = entries[i].data;
+    }
+    return 0;
+}
+
+int cmos_read_range(cmos_t *h, uint32_t offset, uint8_t *buf, size_t count)
+{
+    return cmos_range(h, offset, buf, count, MY_DEV_OP_READ);
+}
+
+int cmos_write_range(cmos_t *h, uint32_t offset, const uint8_t *buf, size_t count)
+{
+    return cmos_range(h, offset, (uint8_t *)buf, count, MY_DEV_OP_WRITE);
+}
+
+int cmos_shadow_snapshot(cmos_t *h, uint8_t *nvram, uint32_t *seq)
+{
+    if( !(h->paths & CMOS_PATH_MMAP) )
+        return -EOPNOTSUPP;
+
+    h->last = CMOS_PATH_MMAP;
+    do
+    {
+        cmos_shadow_begin(h->page, seq);
+        memcpy(nvram, h->page->nvram, MY_DEV_NVRAM_SIZE);
+    } while( cmos_shadow_retry(h->page, seq) );
+    return 0;
+}
+
+int cmos_flush(cmos_t *h)
+{
+    if( h->paths & CMOS_PATH_PORTS )
+        return 0;
+    return cmos_ioctl(h, MY_DEV_FLUSH, NULL);
+}
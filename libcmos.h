@@ -0,0 +1,64 @@
+/******************************************************************************************
+ * libcmos: NVRAM access from user space through one persistent handle
+ *
+ * cmos_open() finds out once which ways in the running system offers, and every call then
+ * takes the fastest one that can serve it:
+ *     CMOS_PATH_MMAP   cached reads straight from the driver's shadow page, no syscall
+ *     CMOS_PATH_VEC    ranges and batches in one MY_DEV_READV per MY_DEV_VEC_MAX entries
+ *     CMOS_PATH_IOCTL  one MY_DEV_READ, MY_DEV_WRITE, ... per byte; always there with the driver
+ *     CMOS_PATH_PORTS  no driver loaded: one ioperm() grant, then in/out as cmos_user.c did
+ *
+ * Offsets are in the driver's unified 256-byte space (cmos_dev.h). Without the driver only
+ * bank 1 (0x80-0xFF) can be reached; bank 0 shares its ports with the kernel's RTC driver.
+ * Calls return 0 or -errno. A handle is not thread safe: open one per thread.
+ *
+ * Build it into the program that uses it:
+ *     gcc -O2 -o cmos_dev_user cmos_dev_user.c libcmos.c
+ *****************************************************************************************/
+
+#ifndef _LIBCMOS_H
+#define _LIBCMOS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cmos_dev.h"
+
+#define CMOS_PATH_MMAP    0x01
+#define CMOS_PATH_VEC     0x02
+#define CMOS_PATH_IOCTL   0x04    // leaving this out leaves the driver out altogether
+#define CMOS_PATH_PORTS   0x08
+
+typedef struct cmos cmos_t;
+
+// Open path, or $MY_DEV, or /dev/DEV_NAME. Paths in avoid are never taken, e.g. to measure
+// one path alone; the ports are only tried if the driver is not there. NULL and errno on failure.
+cmos_t     *cmos_open(const char *path, unsigned avoid);
+void        cmos_close(cmos_t *h);
+
+const char *cmos_default_path(void);
+unsigned    cmos_paths(const cmos_t *h);          // CMOS_PATH_* the handle may take
+unsigned    cmos_last_path(const cmos_t *h);      // CMOS_PATH_* the last call took
+const char *cmos_path_name(unsigned path);
+int         cmos_fd(const cmos_t *h);             // for ioctls not wrapped here; -1 on the ports
+
+int cmos_read(cmos_t *h, uint32_t offset, uint8_t *val);
+int cmos_read_hw(cmos_t *h, uint32_t offset, uint8_t *val);    // skip the shadow, re-read the port
+int cmos_write(cmos_t *h, uint32_t offset, uint8_t val);
+int cmos_read_range(cmos_t *h, uint32_t offset, uint8_t *buf, size_t count);
+int cmos_write_range(cmos_t *h, uint32_t offset, const uint8_t *buf, size_t count);
+
+// op is MY_DEV_OP_SET_BITS .. MY_DEV_OP_CMPXCHG; fills rmw->old like the MY_DEV_SET_BITS family.
+// Atomic through the driver, a plain read then write on the ports.
+int cmos_rmw(cmos_t *h, unsigned op, mydev_rmw_t *rmw);
+
+// Entries as in MY_DEV_READV, run under one driver lock hold per MY_DEV_VEC_MAX entries
+int cmos_batch(cmos_t *h, mydev_vec_entry_t *entries, size_t count);
+
+// Consistent copy of the whole shadow page and the seq of each bank; CMOS_PATH_MMAP only
+int cmos_shadow_snapshot(cmos_t *h, uint8_t *nvram, uint32_t *seq);
+
+// Land writes the driver holds back in write-back mode; nothing to do on the ports
+int cmos_flush(cmos_t *h);
+
+#endif /* _LIBCMOS_H */